@@ -0,0 +1,22 @@
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;; BENCHMARKS ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+
+;;;;;;;FIB
+
+(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(fib 27)
+
+;;;;;;;TAK
+
+(define (tak x y z) (if (>= y x) z (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))))
+(tak 22 16 8)
+
+;;;;;;;LOOP
+
+(define (loop i acc) (if (= i 0) acc (loop (- i 1) (+ acc 1))))
+(loop 3000000 0)
+
+;;;;;;;RATIONAL_SUM
+
+(define (harmonic n acc) (if (= n 0) acc (harmonic (- n 1) (+ acc (/ 1 n)))))
+(harmonic 20 0)
@@ -3,28 +3,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "interpreter.h"
 
 
 
 
-/* The environment struct. Keeping the name and value of function or variable.
-   This is linked lists*/
-typedef struct Node{
-    char* name;
-    void* value;
-    struct Node* next;
-} Node;
-
 typedef struct {
     char *param;
     int (*body)(int); 
 } Function;
 
-typedef struct Env {
-    Node* begin;
-    struct Env* parent;
-} Env;
-
 /* Struct for keeping tokens*/
 typedef struct {
     char** tokens;
@@ -32,25 +34,139 @@ typedef struct {
     int alloc_len;
 } TokenList;
 
+typedef struct Frame Frame;
+
+/* Values are carved out of slabs of cells rather than malloc'd one by one.
+   Slabs are aligned to their size, so a cell finds its slab by masking. */
+#define SLAB_BYTES 65536
+#define SLAB_CELLS ((SLAB_BYTES - sizeof(void*)) / (sizeof(data) + 1))
+
+typedef struct Slab {
+    struct Slab* next;
+    unsigned char used[SLAB_CELLS];
+    data cells[SLAB_CELLS];
+} Slab;
+
+_Static_assert(sizeof(Slab) <= SLAB_BYTES, "slab larger than its alignment");
+
+#define RESERVE_BYTES (1024 * 1024)   /* kept back for running out of memory */
+
+/* A value or an environment the collector has marked but not scanned. */
+typedef struct Gray {
+    data* d;
+    Env* e;
+} Gray;
+
+/* A file evaluated by require and the environment its forms ran in. */
+typedef struct Module {
+    char* path;     /* as returned by realpath */
+    Env* env;
+} Module;
+
+/* All state of one interpreter. Nothing else is global, so several
+   interpreters can live side by side in one process. */
+struct Interp {
+    Env* glob_env;
+    data** args;    /* argument buffer shared by all builtin calls */
+    int args_len;
+    int args_cap;
+    Slab* slabs;    /* every allocated value, for the collector */
+    data* free_cells;
+    Env* envs;      /* every allocated environment */
+    long live_objects;
+    size_t bytes_since_gc;
+    size_t gc_threshold;
+    data* last_result;
+    int jit_enabled;
+    int jit_bail;               /* set by compiled code that gives up */
+    uintptr_t jit_stack_limit;  /* compiled code bails below this address */
+    int optimize;
+    int dump_optimized;
+    Frame* frames;              /* continuation stack of the evaluator */
+    int frames_len;
+    int frames_cap;
+    size_t stack_limit;         /* bytes the frames may take */
+    int eval_depth;             /* nested runs of the evaluator */
+    const char* error;          /* set when an evaluation is aborted */
+    int gc_paused;
+    long fuel_limit;            /* calls per top-level form, 0 for no limit */
+    long fuel;                  /* calls left for the current form */
+    size_t alloc_limit;         /* bytes per top-level form, 0 for no limit */
+    size_t bytes_allocated;     /* since the interpreter was created */
+    size_t alloc_stop;          /* bytes_allocated that ends the form */
+    void* reserve;              /* freed when the system runs out of memory */
+    Module* modules;            /* files evaluated by require */
+    int modules_len;
+    data* autoloads;            /* name -> lazy definitions not run yet */
+    data* callee;               /* the builtin being called */
+    long errors;                /* error messages reported so far */
+    Gray* gray;                 /* mark stack of the collector */
+    int gray_len;
+    int gray_cap;
+};
+
+/* Called when the system runs out of memory. Gives back the reserve so the
+   current form can run on to the next check, where it stops as if it had
+   gone over its allocation limit; aborts if the reserve is already gone. */
+void release_reserve(Interp* in) {
+    if (in->reserve == NULL) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    free(in->reserve);
+    in->reserve = NULL;
+    in->alloc_stop = 0;
+}
+
+/* malloc for the evaluator's own structures, falling back on the reserve. */
+void* checked_malloc(Interp* in, size_t size) {
+    void* p = malloc(size);
+    if (p == NULL) {
+        release_reserve(in);
+        p = malloc(size);
+    }
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    return p;
+}
+
 /* Creating empty environment (linked lists)*/
-Env* create_environment(Env* parent) {
-    Env* e = malloc(sizeof(Env));
+Env* create_environment(Interp* in, Env* parent) {
+    Env* e = checked_malloc(in, sizeof(Env));
     e->begin = NULL;
     e->parent = parent;
+    e->lazy = 0;
+    e->marked = 0;
+    e->gc_next = in->envs;
+    in->envs = e;
+    in->bytes_since_gc += sizeof(Env);
+    in->bytes_allocated += sizeof(Env);
     return e;
 }
 
-Env* glob_env;
-
 /* Adds new nodes to linked list.*/
-void add_elements_to_environment(Env* e, char* name, void* value) {
-    Node* new_node = malloc(sizeof(Node));
-    new_node->name = strdup(name);
+void add_elements_to_environment(Interp* in, Env* e, char* name, void* value) {
+    Node* new_node = checked_malloc(in, sizeof(Node));
+    new_node->name = strcpy(checked_malloc(in, strlen(name) + 1), name);
     new_node->value = value;
     new_node->next = e->begin;
     e->begin = new_node;
 }
 
+/* Binds name in e itself, replacing an earlier binding of the same frame
+   so that redefinitions do not keep the old value alive. */
+void define_variable(Interp* in, Env* e, char* name, void* value) {
+    for (Node* curr = e->begin; curr != NULL; curr = curr->next) {
+        if (strcmp(curr->name, name) == 0) {
+            curr->value = value;
+            return;
+        }
+    }
+    add_elements_to_environment(in, e, name, value);
+}
+
 
 /* Looks up values*/
 void* lookup(Env* e, char* name) {
@@ -86,66 +202,126 @@ void add_token(TokenList* t_list, char* token) {
     t_list->log_len++;
 }
 
-/* Tokenizes input and writes into t_list. */
-void tokenize_input(TokenList* t_list, char input[]) {
-    int i = 0;
-    while (input[i] != '\0') {
-        if (input[i] == '\n' || input[i] == ' ' || input[i] == '\r') {
-            i++;
-            continue;
-        }
-        if (input[i] == '\'') {
-            char t[2] = {input[i], '\0'};
-            add_token(t_list, t);
-            i++;
-            continue;
-        }
-        if (input[i] == '(' || input[i] == ')') {
-            char t[2] = {input[i], '\0'};
-            add_token(t_list, t);
-            i++;
-            continue;
+/* Character classes for the tokenizer, so finding the end of a run of
+   whitespace or of an atom is one table lookup per byte. */
+enum { CC_ATOM, CC_SPACE, CC_PAREN, CC_QUOTE, CC_STRING, CC_COMMENT };
+
+const unsigned char char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\r'] = CC_SPACE, ['\f'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['('] = CC_PAREN, [')'] = CC_PAREN, ['\''] = CC_QUOTE,
+    ['"'] = CC_STRING, [';'] = CC_COMMENT
+};
+
+#define PORT_BUFFER_SIZE (256 * 1024)
+
+/* A file opened for reading or writing. Input ports read the file in large
+   chunks into buf; output ports write through a FILE with a buffer of the
+   same size. The tokenizer also runs on a Port wrapping a string (f NULL). */
+struct Port {
+    FILE* f;
+    int input;
+    char* buf;
+    size_t pos;
+    size_t len;
+};
+
+/* Token text being collected, possibly across several buffer refills. */
+typedef struct {
+    char* text;
+    size_t len;
+    size_t cap;
+} TokenBuf;
+
+void token_append(TokenBuf* tok, const char* s, size_t n) {
+    if (tok->len + n + 1 > tok->cap) {
+        while (tok->len + n + 1 > tok->cap)
+            tok->cap = tok->cap ? tok->cap * 2 : 64;
+        tok->text = realloc(tok->text, tok->cap);
+    }
+    memcpy(tok->text + tok->len, s, n);
+    tok->len += n;
+    tok->text[tok->len] = '\0';
+}
+
+/* Reads the next chunk of the file. Returns 0 at the end of the input. */
+int refill_port(Port* p) {
+    if (p->f == NULL)
+        return 0;
+    p->pos = 0;
+    p->len = fread(p->buf, 1, PORT_BUFFER_SIZE, p->f);
+    return p->len > 0;
+}
+
+/* Scans the next token into tok. Returns 1 for a token, 0 at the end of
+   the input and -1 for an unterminated string. Whitespace and comments
+   from ; to the end of the line are skipped. */
+int next_token(Port* p, TokenBuf* tok) {
+    tok->len = 0;
+    while (1) {
+        if (p->pos >= p->len && !refill_port(p))
+            return 0;
+        int cls = char_class[(unsigned char) p->buf[p->pos]];
+        if (cls == CC_SPACE) {
+            p->pos++;
+        } else if (cls == CC_COMMENT) {
+            char* nl = memchr(p->buf + p->pos, '\n', p->len - p->pos);
+            p->pos = nl ? (size_t) (nl - p->buf) : p->len;
+        } else {
+            break;
         }
-        if (input[i] == '"') {
-            int start = i;  
-            i++; 
-            while (input[i] != '\0') {
-                if (input[i] == '\\') { 
-                    if (input[i+1] == '\0') {
-                        fprintf(stderr, "Error: Unterminated escape sequence in string literal\n");
-                        exit(1);
-                    }
-                    i += 2;
-                } else if (input[i] == '"') {
-                    break;  
-                } else {
-                    i++;
-                }
-            }
-            if (input[i] == '\0') {
-                fprintf(stderr, "Error: Unterminated string literal\n");
-                exit(1);
+    }
+    char c = p->buf[p->pos];
+    int cls = char_class[(unsigned char) c];
+    if (cls == CC_PAREN || cls == CC_QUOTE) {
+        token_append(tok, &c, 1);
+        p->pos++;
+        return 1;
+    }
+    if (cls == CC_STRING) {
+        token_append(tok, &c, 1);
+        p->pos++;
+        int escaped = 0;
+        while (1) {
+            if (p->pos >= p->len && !refill_port(p)) {
+                fprintf(stderr, escaped ? "Error: Unterminated escape sequence in string literal\n"
+                                        : "Error: Unterminated string literal\n");
+                return -1;
             }
-            int length = i - start + 1;
-            char* token = malloc(length + 1);
-            strncpy(token, input + start, length);
-            token[length] = '\0';
-            add_token(t_list, token);
-            free(token);
-            i++; 
-            continue;
+            c = p->buf[p->pos++];
+            token_append(tok, &c, 1);
+            if (escaped)
+                escaped = 0;
+            else if (c == '\\')
+                escaped = 1;
+            else if (c == '"')
+                return 1;
         }
-        int start = i;
-        while (input[i] != ' ' && input[i] != '(' && input[i] != ')' && input[i] != '\0') {
-            i++;
+    }
+    /* an atom runs up to whitespace, a parenthesis or a comment */
+    while (1) {
+        size_t start = p->pos;
+        while (p->pos < p->len) {
+            int k = char_class[(unsigned char) p->buf[p->pos]];
+            if (k == CC_SPACE || k == CC_PAREN || k == CC_COMMENT)
+                break;
+            p->pos++;
         }
-        char t[i - start + 1];
-        strncpy(t, input + start, i - start);
-        t[i - start] = '\0';
-        add_token(t_list, t);
+        token_append(tok, p->buf + start, p->pos - start);
+        if (p->pos < p->len || !refill_port(p))
+            return 1;
     }
 }
 
+/* Tokenizes input and writes into t_list. */
+void tokenize_input(TokenList* t_list, const char input[]) {
+    Port src = { NULL, 1, (char*) input, 0, strlen(input) };
+    TokenBuf tok = { NULL, 0, 0 };
+    while (next_token(&src, &tok) > 0)
+        add_token(t_list, tok.text);
+    free(tok.text);
+}
+
 int is_operator(char *symbol) {
     return (strcmp(symbol, "+") == 0 ||
             strcmp(symbol, "-") == 0 ||
@@ -154,71 +330,182 @@ int is_operator(char *symbol) {
             strcmp(symbol, "<") == 0 ||
             strcmp(symbol, ">") == 0 ||
             strcmp(symbol, "=") == 0 ||
+            strcmp(symbol, "<=") == 0 ||
+            strcmp(symbol, ">=") == 0 ||
             strcmp(symbol, "and") == 0 ||
             strcmp(symbol, "or") == 0);
 }
 
-void* eval(void* exp, Env* e);
-
-typedef enum { SYMBOL, INTEGER, FLOAT, RATIONAL, STRING, LAMBDA, PAIR, OPERATOR, BUILT} types;
-
-typedef struct data {
-    types type;
-    union {
-        int integer;
-        struct {
-            int num;
-            int den;
-        } rational;
-        double floating;
-        char* symbol;
-        char* string;
-        struct {
-           /* void (*body)(int);
-            char* parameter;*/
-            struct data* parameter;
-            struct data* body;
-            Env* e;
-        } lambda;
-        struct {
-            void* first;
-            void* second;
-        } pairs;
-        struct {
-            struct data* (*fn)(struct data* args);
-        } builtin;
-    } value;
-} data;
-
-data* create_int(int val) {
-    data* d = malloc(sizeof(data));
-    d->type = INTEGER;
+/* Forms that eval handles itself instead of applying a procedure. */
+int is_special_form(char* symbol) {
+    return (strcmp(symbol, "quote") == 0 ||
+            strcmp(symbol, "lambda") == 0 ||
+            strcmp(symbol, "define") == 0 ||
+            strcmp(symbol, "if") == 0 ||
+            strcmp(symbol, "delay") == 0 ||
+            strcmp(symbol, "delay-force") == 0 ||
+            strcmp(symbol, "cons-stream") == 0 ||
+            strcmp(symbol, "define-record-type") == 0 ||
+            strcmp(symbol, "define-memoized") == 0 ||
+            strcmp(symbol, "#%guard") == 0);
+}
+
+void* eval(Interp* in, void* exp, Env* e);
+data* apply_procedure(Interp* in, data* f, int argc);
+data* parse_func(Interp* in, TokenList* tokens, int* ind);
+data* parse_datum(Interp* in, TokenList* tokens, int* ind, int* ok);
+void free_token_list(TokenList* t_list);
+void write_data(FILE* out, data* d, int display);
+void collect_garbage(Interp* in, data* exp, Env* env);
+data* lookup_value(Interp* in, data* x, Env* e, char* name);
+int list_length(data* l);
+void scheme_error(Interp* in, const char* msg);
+
+
+/* Every value is allocated here, from the interpreter's slabs. Values are
+   never freed explicitly: they are shared freely between environments,
+   closures and quoted constants, and collect_garbage frees the ones that
+   are no longer reachable.
+   Free cells are handed out in address order, so values made one after
+   another, like the cells of a list that is being built, sit next to each
+   other and walking the list reads memory sequentially. A free cell keeps
+   the next free cell in value.pairs.first; under AddressSanitizer the rest
+   of it is poisoned so that using a collected value is reported. */
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POISON_CELL(d) (ASAN_POISON_MEMORY_REGION((d), offsetof(data, value)), \
+                        ASAN_POISON_MEMORY_REGION(&(d)->value.pairs.second, \
+                            sizeof(data) - offsetof(data, value.pairs.second)))
+#define UNPOISON_CELL(d) ASAN_UNPOISON_MEMORY_REGION((d), sizeof(data))
+#define ASAN_UNPOISON_SLAB(s) ASAN_UNPOISON_MEMORY_REGION((s), SLAB_BYTES)
+#else
+#define POISON_CELL(d) ((void) 0)
+#define UNPOISON_CELL(d) ((void) 0)
+#define ASAN_UNPOISON_SLAB(s) ((void) 0)
+#endif
+
+/* Links the cells of s whose used flag is clear, in address order, in
+   front of list, and returns the new list. */
+data* thread_free_cells(Slab* s, data* list) {
+    for (int i = (int) SLAB_CELLS - 1; i >= 0; i--) {
+        if (!s->used[i]) {
+            s->cells[i].value.pairs.first = list;
+            POISON_CELL(&s->cells[i]);
+            list = &s->cells[i];
+        }
+    }
+    return list;
+}
+
+/* Slabs are mapped straight from the system rather than taken from the
+   malloc heap, so a slab the collector empties leaves the process at once
+   instead of fragmenting the heap. Twice the size is mapped and trimmed to
+   one aligned slab. */
+Slab* map_slab(void) {
+    char* p = mmap(NULL, 2 * SLAB_BYTES, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    char* s = (char*) (((uintptr_t) p + SLAB_BYTES - 1) & ~(uintptr_t) (SLAB_BYTES - 1));
+    if (s > p)
+        munmap(p, s - p);
+    munmap(s + SLAB_BYTES, p + SLAB_BYTES - s);
+    return (Slab*) s;
+}
+
+void unmap_slab(Slab* s) {
+    ASAN_UNPOISON_SLAB(s);
+    munmap(s, SLAB_BYTES);
+}
+
+Slab* slab_of(data* d) {
+    return (Slab*) ((uintptr_t) d & ~(uintptr_t) (SLAB_BYTES - 1));
+}
+
+data* alloc_data(Interp* in, types type) {
+    if (in->free_cells == NULL) {
+        Slab* s = map_slab();
+        if (s == NULL) {
+            release_reserve(in);
+            s = map_slab();
+        }
+        if (s == NULL) {
+            fprintf(stderr, "out of memory\n");
+            abort();
+        }
+        memset(s->used, 0, sizeof(s->used));
+        s->next = in->slabs;
+        in->slabs = s;
+        in->free_cells = thread_free_cells(s, NULL);
+    }
+    data* d = in->free_cells;
+    UNPOISON_CELL(d);
+    in->free_cells = d->value.pairs.first;
+    Slab* s = slab_of(d);
+    s->used[d - s->cells] = 1;
+    d->type = type;
+    d->marked = 0;
+    in->live_objects++;
+    in->bytes_since_gc += sizeof(data);
+    in->bytes_allocated += sizeof(data);
+    return d;
+}
+
+/* Counts bytes a value takes besides its cell. The allocation limit is
+   otherwise only checked when a procedure is applied, so arrays are checked
+   here, before they are made. */
+int account_bytes(Interp* in, size_t bytes) {
+    if (in->bytes_allocated > in->alloc_stop || bytes > in->alloc_stop - in->bytes_allocated) {
+        scheme_error(in, "allocation limit exceeded");
+        return 0;
+    }
+    in->bytes_since_gc += bytes;
+    in->bytes_allocated += bytes;
+    return 1;
+}
+
+data* create_int(Interp* in, int val) {
+    data* d = alloc_data(in, INTEGER);
     d->value.integer = val;
     return d;
 }
 
-data* create_symbol(const char* val) {
-    data* d = malloc(sizeof(data));
-    d->type = SYMBOL;
+data* create_symbol(Interp* in, const char* val) {
+    data* d = alloc_data(in, SYMBOL);
     d->value.symbol = strdup(val);
     return d;
 }
 
 
-data* create_pair(data* first, data* second) {
-    data* d = malloc(sizeof(data));
-    d->type = PAIR;
+data* create_pair(Interp* in, data* first, data* second) {
+    data* d = alloc_data(in, PAIR);
     d->value.pairs.first = first;
     d->value.pairs.second = second;
     return d;
 }
 
-data* create_lambda(data* parameter, data* body, Env* e) {
-    data* d = malloc(sizeof(data));
-    d->type = LAMBDA;
+/* Makes a list of the n items ending in tail. The cells are allocated in
+   order, so they usually end up next to each other. */
+data* create_list(Interp* in, data** items, int n, data* tail) {
+    data* head = tail;
+    data* last = NULL;
+    for (int i = 0; i < n; i++) {
+        data* cell = create_pair(in, items[i], tail);
+        if (last == NULL)
+            head = cell;
+        else
+            last->value.pairs.second = cell;
+        last = cell;
+    }
+    return head;
+}
+
+data* create_lambda(Interp* in, data* parameter, data* body, Env* e) {
+    data* d = alloc_data(in, LAMBDA);
     d->value.lambda.parameter = parameter;
     d->value.lambda.e = e;
     d->value.lambda.body = body;
+    d->value.lambda.jit = NULL;
     return d;
 }
 
@@ -229,10 +516,10 @@ int gcd (int a, int b) {
     return gcd(b, a % b);
 }
 
-data* create_rational(int num, int den) {
+data* create_rational(Interp* in, int num, int den) {
     if (den == 0) {
-        printf("division by zero\n");
-        exit(1);
+        scheme_error(in, "division by zero");
+        return NULL;
     }
     int g = gcd(num, den);
     num /= g;
@@ -241,146 +528,128 @@ data* create_rational(int num, int den) {
         num = -num;
         den = -den;
     }
-    data* d = malloc(sizeof(data));
-    d->type = RATIONAL;
+    data* d = alloc_data(in, RATIONAL);
     d->value.rational.num = num;
     d->value.rational.den = den;
     return d;
 }
 
-data* create_string(const char* s) {
-    data* d = malloc(sizeof(data));
-    d->type = STRING;
+data* create_string(Interp* in, const char* s) {
+    data* d = alloc_data(in, STRING);
     d->value.string = strdup(s);
     return d;
 }
 
-data* create_float(double val) {
-    data* d = malloc(sizeof(data));
-    d->type = FLOAT;
+data* create_float(Interp* in, double val) {
+    data* d = alloc_data(in, FLOAT);
     d->value.floating = val;
     return d;
 }
 
 
-data* to_rational(data* n) {
-    if (n->type == INTEGER) {
-        return create_rational(n->value.integer, 1);
-    } else if (n->type == RATIONAL) {
-        return create_rational(n->value.rational.num, n->value.rational.den);
-    } else {
-        printf("error\n");
-        exit(1);
-    }
-}
-
-
 data* car(data* exp) {
-    if (exp->type == PAIR && exp) {
+    if (exp && exp->type == PAIR) {
         return (data*)exp->value.pairs.first;
     }
     return NULL;
 }
 
 data* cdr(data* exp) {
-    if (exp->type == PAIR && exp) {
+    if (exp && exp->type == PAIR) {
         return (data*) exp->value.pairs.second;
     }
     return NULL;
 }
 
-data* create_builtin(data* (*fn)(data* args)) {
-    data* d = malloc(sizeof(data));
-    d->type = BUILT;
+/* max_args of -1 means any number of arguments from min_args up. */
+data* create_builtin(Interp* in, const char* name, builtin_fn fn, int min_args, int max_args) {
+    data* d = alloc_data(in, BUILT);
     d->value.builtin.fn = fn;
+    d->value.builtin.name = name;
+    d->value.builtin.min_args = min_args;
+    d->value.builtin.max_args = max_args;
+    d->value.builtin.info = NULL;
     return d;
 }
 
-data* cons_builtin(data* args) {
-    data* first = car(args);
-    data* second = car(cdr(args));
-    return create_pair(first, second);
-}
-
-data* car_builtin(data* args) {
-    data* arg = car(args);
-    if (arg == NULL || arg->type != PAIR) {
-        printf("expected pair\n");
-        return NULL;
+/* Reserves the evaluator's argument buffer for one more value. Builtins get
+   a window of this buffer as argv, so argv stays valid only until the
+   builtin calls back into eval, which may grow (and move) the buffer. */
+void push_arg(Interp* in, data* value) {
+    if (in->args_len >= in->args_cap) {
+        in->args_cap *= 2;
+        in->args = realloc(in->args, in->args_cap * sizeof(data*));
     }
-    return car(arg);
+    in->args[in->args_len] = value;
+    in->args_len++;
 }
 
-data* cdr_builtin(data* args) {
-    data* arg = car(args);
-    if (arg == NULL || arg->type != PAIR) {
-        printf("expected pair\n");
-        return NULL;
-    } 
-    return cdr(arg);
+/* Prints an error message. Most errors only make the expression evaluate
+   to NULL, so they are counted for callers that need to tell. */
+void report_error(Interp* in, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    in->errors++;
 }
 
-data* evaluate_list (data* arglist, Env* e) {
-    if (arglist == NULL) {
-        return NULL;
-    } else if (arglist->type != PAIR) {
-        return NULL;
+/* Checks the argument count against the builtin's declared arity. */
+int check_arity(Interp* in, data* f, int argc) {
+    if (argc < f->value.builtin.min_args ||
+        (f->value.builtin.max_args >= 0 && argc > f->value.builtin.max_args)) {
+        if (f->value.builtin.min_args == f->value.builtin.max_args)
+            report_error(in, "%s: expected %d arguments\n", f->value.builtin.name, f->value.builtin.min_args);
+        else
+            report_error(in, "%s: wrong number of arguments\n", f->value.builtin.name);
+        return 0;
     }
-    data* first = (data*)eval(car(arglist), e);
-    data* second = evaluate_list(cdr(arglist), e);
-    return create_pair(first, second);
+    return 1;
 }
 
-data* map_builtin(data* args) {
-    if (args == NULL) {
-        printf("Map: expected 2 arguments\n");
-        return NULL;
-    }
-    data* first_ = car(args);
-    data* second_ = car(cdr(args));
-    if (first_ == NULL || second_ == NULL) {
-        printf("Map: missing arguments\n");
-        return NULL;
+/* Calls a builtin on the top argc values of the argument buffer, which are
+   popped afterwards. */
+data* call_builtin(Interp* in, data* f, int argc) {
+    int base = in->args_len - argc;
+    data* result = NULL;
+    if (check_arity(in, f, argc)) {
+        in->callee = f;
+        result = f->value.builtin.fn(in, argc, in->args + base);
     }
+    in->args_len = base;
+    return result;
+}
 
-    data* res = NULL;
-    data* last = NULL;
-    while( second_ != NULL && second_->type == PAIR) {
-        data* element = car(second_);
-        data* arg_c = create_pair(element, NULL);
-        data* app = create_pair(first_, arg_c);
-        
-        Env* fe = NULL;
-        if (first_->type == LAMBDA) {
-            fe = first_ ->value.lambda.e;
-        }
+data* cons_builtin(Interp* in, int argc, data** argv) {
+    return create_pair(in, argv[0], argv[1]);
+}
 
-        data* res2 = (data*) eval(app, fe);
-        data* cell = create_pair(res2, NULL);
-        if (res == NULL) {
-            res = cell;
-            last = cell;
-        } else {
-            last->value.pairs.second = cell;
-            last = cell;
-        }
-        second_ = cdr(second_);
+data* car_builtin(Interp* in, int argc, data** argv) {
+    data* arg = argv[0];
+    if (arg == NULL || arg->type != PAIR) {
+        report_error(in, "expected pair\n");
+        return NULL;
     }
-    return res;
+    return car(arg);
 }
 
-data* append_builtin(data* args) {
-    if (args == NULL) {
-        printf("Append: expected 2 arguments\n");
+data* cdr_builtin(Interp* in, int argc, data** argv) {
+    data* arg = argv[0];
+    if (arg == NULL || arg->type != PAIR) {
+        report_error(in, "expected pair\n");
         return NULL;
-    }
-    data* lst1 = car(args);
-    data* lst2 = car(cdr(args));
+    } 
+    return cdr(arg);
+}
+
+data* append_builtin(Interp* in, int argc, data** argv) {
+    data* lst1 = argv[0];
+    data* lst2 = argv[1];
     if (lst1 == NULL) {
         return lst2;
     }
     if (lst1->type != PAIR) {
-        printf("Append: first argument is not a list\n");
+        report_error(in, "Append: first argument is not a list\n");
         return NULL;
     }
 
@@ -388,7 +657,7 @@ data* append_builtin(data* args) {
     data* last = NULL;
     data* iter = lst1;
     while (iter != NULL && iter->type == PAIR) {
-        data* cell = create_pair(car(iter), NULL);
+        data* cell = create_pair(in, car(iter), NULL);
         if (result == NULL) {
             result = cell;
             last = cell;
@@ -404,55 +673,59 @@ data* append_builtin(data* args) {
     return result;
 }
 
-data* null_builtin(data* args) {
-    data* arg = car(args);
+data* null_builtin(Interp* in, int argc, data** argv) {
+    data* arg = argv[0];
     if (arg != NULL) {
-        return create_int(0);
+        return create_int(in, 0);
     } else {
-        return create_int(1);
+        return create_int(in, 1);
     }
 }
 
-data* length_builtin(data* args) {
-    data* arg = car(args);
+data* length_builtin(Interp* in, int argc, data** argv) {
+    data* arg = argv[0];
     int counter = 0;
     data* it = arg;
     while(it != NULL && it->type == PAIR) {
         counter++;
         it = cdr(it);
     }
-    return create_int(counter);
+    return create_int(in, counter);
 }
 
-data* apply_builtin(data* args) {
-    data* first = car(args);
-    data* second = car(cdr(args));
+/* apply and eval are run by the evaluator itself when called from Scheme
+   code; these are for calls through call_builtin. */
+data* apply_builtin(Interp* in, int argc, data** argv) {
+    data* first = argv[0];
+    data* second = argv[1];
     if (first == NULL || second == NULL) {
-        printf("Apply: expected 2 arguments\n");
+        report_error(in, "Apply: expected 2 arguments\n");
         return NULL;
     }
 
-    if (first->type == BUILT) {
-        data* evaled = evaluate_list(second, glob_env);
-        return first->value.builtin.fn(evaled);
+    int n = 0;
+    for (data* it = second; it != NULL && it->type == PAIR; it = cdr(it)) {
+        push_arg(in, car(it));
+        n++;
     }
-
-    data* da = create_pair(first, second);
-    return (data*) eval(da, glob_env);
+    return apply_procedure(in, first, n);
 }
 
-data* eval_builtin(data* args) {
-    data* exp = car(args);
+data* eval_builtin(Interp* in, int argc, data** argv) {
+    data* exp = argv[0];
     if(exp == NULL) {
-        printf("Eval: expected an expression\n");
+        report_error(in, "Eval: expected an expression\n");
         return NULL;
     }
-    return (data*) eval(exp, glob_env);
+    return (data*) eval(in, exp, in->glob_env);
 }
 
 
-int equal_data(data* a, data* b) {
-    if (a == b) return 1;  
+#define EQUAL_PARTS 2   /* pairs or records whose parts decide, see equal_data */
+
+/* Compares a and b without looking inside pairs and records. */
+int equal_shallow(data* a, data* b) {
+    if (a == b) return 1;
     if (a == NULL || b == NULL) return 0;
     if (a->type != b->type) {
         if ((a->type == INTEGER || a->type == RATIONAL || a->type == FLOAT) &&
@@ -489,378 +762,3563 @@ int equal_data(data* a, data* b) {
         case SYMBOL:
             return strcmp(a->value.symbol, b->value.symbol) == 0;
         case PAIR:
-            return equal_data(car(a), car(b)) && equal_data(cdr(a), cdr(b));
+            return EQUAL_PARTS;
         case LAMBDA:
             return a == b;
         case BUILT:
             return a == b;
+        case RECORD:
+            return a->value.record.type == b->value.record.type ? EQUAL_PARTS : 0;
+        case BYTEVECTOR:
+            return a->value.bytevector.length == b->value.bytevector.length &&
+                   (a->value.bytevector.length == 0 ||
+                    memcmp(a->value.bytevector.bytes, b->value.bytevector.bytes,
+                           a->value.bytevector.length) == 0);
         default:
             return 0;
     }
 }
 
-data* equal_builtin(data* args) {
-    data* first = car(args);
-    data* second = car(cdr(args));
-    if (first == NULL || second == NULL) {
-        //printf("equal?: expected 2 arguments\n");
-        return NULL;
+/* The parts still to compare wait on a stack on the heap, so long lists
+   and deeply nested cars do not use up the C stack. */
+int equal_data(data* a, data* b) {
+    data* local[64];
+    data** pending = local;
+    int len = 0;
+    int cap = 64;
+    int same = 1;
+    for (;;) {
+        int r = equal_shallow(a, b);
+        if (r == 0) {
+            same = 0;
+            break;
+        }
+        if (r == EQUAL_PARTS) {
+            int n = a->type == PAIR ? 2 : a->value.record.count;
+            if (len + 2 * n > cap) {
+                cap = 2 * (len + 2 * n);
+                data** bigger = malloc(cap * sizeof(data*));
+                memcpy(bigger, pending, len * sizeof(data*));
+                if (pending != local)
+                    free(pending);
+                pending = bigger;
+            }
+            /* the cdr waits while the car is compared */
+            for (int i = n - 1; i >= 0; i--) {
+                pending[len++] = a->type == PAIR ? (i ? cdr(a) : car(a)) : a->value.record.slots[i];
+                pending[len++] = b->type == PAIR ? (i ? cdr(b) : car(b)) : b->value.record.slots[i];
+            }
+        }
+        if (len == 0)
+            break;
+        b = pending[--len];
+        a = pending[--len];
     }
-    int eq = equal_data(first, second);
-    return create_int(eq);
+    if (pending != local)
+        free(pending);
+    return same;
+}
+
+data* equal_builtin(Interp* in, int argc, data** argv) {
+    /* NULL is the empty list, which is only equal to itself */
+    return create_int(in, equal_data(argv[0], argv[1]));
 }
 
 
-// Recursively free 
-void free_data(data* d) {
-    if (d == NULL) return;
-    switch(d->type) {
-        case INTEGER:
-            free(d);
-            break;
-        case SYMBOL:
-            free(d->value.symbol);
-            free(d);
-            break;
-        case LAMBDA:
-            free_data(d->value.lambda.parameter);
-            free_data(d->value.lambda.body);
-            free(d);
-            break;
-        case PAIR:
-            free_data(d->value.pairs.first);
-            free_data(d->value.pairs.second);
-            free(d);
-            break;
-        case BUILT:
-            free(d);
-            break;
-        default:
-            free(d);
-            break;
+/* Hash tables. Open addressing with linear probing over a power of two
+   number of slots; deleted slots are left as tombstones until the next
+   resize. Keys are compared either with equal_data (equal?-style) or
+   with eqv_data (eq?-style), and hashed consistently with that choice. */
+enum { SLOT_EMPTY, SLOT_FULL, SLOT_DELETED };
+
+typedef struct {
+    unsigned int hash;
+    int state;
+    data* key;
+    data* value;
+} HashEntry;
+
+struct HashTable {
+    int equal_keys;
+    int count;
+    int used;
+    int capacity;
+    HashEntry* entries;
+};
+
+/* eq?: same object, or numbers/symbols with the same value, since
+   neither numbers nor symbols are shared between evaluations. */
+int eqv_data(data* a, data* b) {
+    if (a == b) return 1;
+    if (a == NULL || b == NULL) return 0;
+    if ((a->type == INTEGER || a->type == RATIONAL || a->type == FLOAT) &&
+        (b->type == INTEGER || b->type == RATIONAL || b->type == FLOAT))
+        return equal_data(a, b);
+    if (a->type == SYMBOL && b->type == SYMBOL)
+        return strcmp(a->value.symbol, b->value.symbol) == 0;
+    return 0;
+}
+
+unsigned int mix_hash(unsigned int h, unsigned int v) {
+    h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+    return h;
+}
+
+unsigned int hash_string(const char* s, unsigned int seed) {
+    unsigned int h = 2166136261u ^ seed;
+    for (; *s != '\0'; s++) {
+        h ^= (unsigned char) *s;
+        h *= 16777619u;
     }
+    return h;
 }
 
+unsigned int hash_pointer(void* p) {
+    unsigned long long v = (unsigned long long) (size_t) p;
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    return (unsigned int) v;
+}
 
-data* clone_data(data* d) {
-    if (!d) return NULL;
-    data* copy = malloc(sizeof(data));
-    copy->type = d->type;
-    switch(d->type) {
+/* equal_data compares numbers of different types by their double value,
+   so every number is hashed through its double value too. */
+unsigned int hash_number(data* d) {
+    double v;
+    if (d->type == INTEGER)
+        v = d->value.integer;
+    else if (d->type == FLOAT)
+        v = d->value.floating;
+    else
+        v = (double) d->value.rational.num / d->value.rational.den;
+    if (v == 0)
+        v = 0;
+    unsigned long long bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return hash_pointer((void*) (size_t) bits);
+}
+
+/* How deep the printer and hash functions follow nested cars and record
+   slots; deeper parts are printed as ... and left out of the hash. */
+#define MAX_NESTING 10000
+
+unsigned int hash_nested(data* d, int equal_keys, int depth) {
+    if (d == NULL) return 0x2545f491u;
+    if (depth > MAX_NESTING) return 0x9e3779b9u;
+    switch (d->type) {
         case INTEGER:
-            copy->value.integer = d->value.integer;
-            break;
         case FLOAT:
-            copy->value.floating = d->value.floating;
-            break;
         case RATIONAL:
-            copy->value.rational.num = d->value.rational.num;
-            copy->value.rational.den = d->value.rational.den;
-            break;
-        case STRING:
-            copy->value.string = strdup(d->value.string);
-            break;
+            return hash_number(d);
         case SYMBOL:
-            copy->value.symbol = strdup(d->value.symbol);
-            break;
-        case PAIR:
-            copy->value.pairs.first = clone_data(car(d));
-            copy->value.pairs.second = clone_data(cdr(d));
-            break;
-        case LAMBDA:
-            copy->value.lambda.parameter = clone_data(d->value.lambda.parameter);
-            copy->value.lambda.body = clone_data(d->value.lambda.body);
-            copy->value.lambda.e = d->value.lambda.e; 
-            break;
-        case BUILT:
-            copy->value.builtin.fn = d->value.builtin.fn;
-            break;
+            return hash_string(d->value.symbol, 1);
+        case STRING:
+            if (equal_keys)
+                return hash_string(d->value.string, 2);
+            return hash_pointer(d);
+        case PAIR: {
+            if (!equal_keys)
+                return hash_pointer(d);
+            unsigned int h = 0x811c9dc5u;
+            data* it = d;
+            while (it != NULL && it->type == PAIR) {
+                h = mix_hash(h, hash_nested(car(it), 1, depth + 1));
+                it = cdr(it);
+            }
+            return mix_hash(h, hash_nested(it, 1, depth + 1));
+        }
+        case RECORD: {
+            if (!equal_keys)
+                return hash_pointer(d);
+            unsigned int h = hash_pointer(d->value.record.type);
+            for (int i = 0; i < d->value.record.count; i++)
+                h = mix_hash(h, hash_nested(d->value.record.slots[i], 1, depth + 1));
+            return h;
+        }
+        case BYTEVECTOR: {
+            if (!equal_keys)
+                return hash_pointer(d);
+            unsigned int h = 0x811c9dc5u;
+            for (size_t i = 0; i < d->value.bytevector.length; i++)
+                h = (h ^ d->value.bytevector.bytes[i]) * 0x01000193u;
+            return h;
+        }
         default:
-            break;
+            return hash_pointer(d);
     }
-    return copy;
 }
 
+unsigned int hash_data(data* d, int equal_keys) {
+    return hash_nested(d, equal_keys, 0);
+}
 
+HashTable* create_hash_table(Interp* in, int equal_keys, int capacity) {
+    if (!account_bytes(in, capacity * sizeof(HashEntry)))
+        return NULL;
+    HashTable* t = malloc(sizeof(HashTable));
+    t->equal_keys = equal_keys;
+    t->count = 0;
+    t->used = 0;
+    t->capacity = capacity;
+    t->entries = calloc(capacity, sizeof(HashEntry));
+    return t;
+}
 
-void* eval(void* exp, Env* e) {
-    data* d = (data*) exp;
-    if (d == NULL) {
-        return NULL;
-    }
-    if (d->type == FLOAT || d->type == INTEGER || d->type == STRING || d->type == RATIONAL) {
-        return d;
-    } else if (d->type == SYMBOL) {
-        void* val = lookup(e, d->value.symbol);
-        if (val == NULL && is_operator(d->value.symbol))
-            return d;
-        return val;
-
-    } else if (d->type == LAMBDA) {
-        return d;
-    } else if (d->type == PAIR) {
-        data* first = car(d);
-        if (first && first->type == SYMBOL && strcmp(first->value.symbol, "quote") == 0) {
-            return car(cdr(d));
-        }    
-        if (first && first->type == SYMBOL) {
-            if (strcmp(first->value.symbol, "lambda") == 0) {
-                data* parameter = car(cdr(d));
-                data* body = car(cdr(cdr(d)));
-                return create_lambda(parameter, body, e);
-            } else if (strcmp(first->value.symbol, "define") == 0) {
-                data* var = car(cdr(d));
-                if (var->type == SYMBOL) {
-                    data* v_exp = car(cdr(cdr(d)));
-                    data* v = (data*) eval(v_exp, e);
-                    data* stored = clone_data(v);
-                    add_elements_to_environment(e, var->value.symbol, stored);
-                    return stored;
-                } else if (var->type == PAIR) {               
-                    data* f_name = car(var);               
-                    data* parameters = cdr(var);              
-                    data* body = car(cdr(cdr(d)));           
-                    Env* lambda_env = create_environment(e);
-                    data* cloned_parameters = clone_data(parameters);
-                    data* cloned_body = clone_data(body);
-                    data* lambda_ = create_lambda(cloned_parameters, cloned_body, lambda_env);
-
-                    add_elements_to_environment(e, f_name->value.symbol, lambda_);
-                    return lambda_;
-                }
-            } else if(strcmp(first->value.symbol, "if") == 0) {
-                data* exp1 = car(cdr(d));         
-                data* exp2 = car(cdr(cdr(d)));     
-                data* exp3 = car(cdr(cdr(cdr(d))));  
-
-                data* cond = (data*) eval(exp1, e);
-                int is_true = 1;  
-                if (cond && cond->type == INTEGER && cond->value.integer == 0) {
-                    is_true = 0;
-                }
-                if (cond && cond->type == SYMBOL && strcmp(cond->value.symbol, "#f") == 0) {
-                    is_true = 0;
-                }
-                return eval(is_true ? exp2 : exp3, e);
-            }
+/* Returns the slot holding key, or the slot where it should be inserted
+   (the first tombstone on its probe path, if any). */
+HashEntry* find_entry(HashTable* t, data* key, unsigned int hash) {
+    unsigned int mask = t->capacity - 1;
+    HashEntry* tombstone = NULL;
+    for (unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+        HashEntry* entry = &t->entries[i];
+        if (entry->state == SLOT_EMPTY)
+            return tombstone != NULL ? tombstone : entry;
+        if (entry->state == SLOT_DELETED) {
+            if (tombstone == NULL)
+                tombstone = entry;
+        } else if (entry->hash == hash &&
+                   (t->equal_keys ? equal_data(entry->key, key) : eqv_data(entry->key, key))) {
+            return entry;
         }
+    }
+}
 
-        data* func_exp = eval(car(d), e);
+int resize_hash_table(Interp* in, HashTable* t, int capacity) {
+    if (!account_bytes(in, capacity * sizeof(HashEntry)))
+        return 0;
+    HashEntry* old = t->entries;
+    int old_capacity = t->capacity;
+    t->entries = calloc(capacity, sizeof(HashEntry));
+    t->capacity = capacity;
+    t->used = t->count;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].state != SLOT_FULL)
+            continue;
+        unsigned int mask = capacity - 1;
+        unsigned int j = old[i].hash & mask;
+        while (t->entries[j].state != SLOT_EMPTY)
+            j = (j + 1) & mask;
+        t->entries[j] = old[i];
+    }
+    free(old);
+    return 1;
+}
 
-        if (func_exp && func_exp->type == LAMBDA) {
-            data* arg_list = cdr(d);
+data* hash_table_get(HashTable* t, data* key, int* found) {
+    HashEntry* entry = find_entry(t, key, hash_data(key, t->equal_keys));
+    *found = entry->state == SLOT_FULL;
+    return *found ? entry->value : NULL;
+}
 
-            // data* arg1_exp = car(arg_list);
-            // data* arg2_exp = car(cdr(arg_list));
+/* Returns 0 if the table had to grow and was not allowed to. */
+int hash_table_put(Interp* in, HashTable* t, data* key, data* value) {
+    if ((t->used + 1) * 4 > t->capacity * 3) {
+        int capacity = t->capacity;
+        if ((t->count + 1) * 2 > capacity)
+            capacity *= 2;
+        if (!resize_hash_table(in, t, capacity))
+            return 0;
+    }
+    unsigned int hash = hash_data(key, t->equal_keys);
+    HashEntry* entry = find_entry(t, key, hash);
+    if (entry->state == SLOT_FULL) {
+        entry->value = value;
+        return 1;
+    }
+    if (entry->state == SLOT_EMPTY)
+        t->used++;
+    entry->state = SLOT_FULL;
+    entry->hash = hash;
+    entry->key = key;
+    entry->value = value;
+    t->count++;
+    return 1;
+}
 
-            // int arg1 = *((int*)eval(arg1_exp, e));
-            // int arg2 = *((int*)eval(arg2_exp, e));
-            // int* res = malloc(sizeof(int));
+int hash_table_remove(HashTable* t, data* key) {
+    HashEntry* entry = find_entry(t, key, hash_data(key, t->equal_keys));
+    if (entry->state != SLOT_FULL)
+        return 0;
+    entry->state = SLOT_DELETED;
+    entry->key = NULL;
+    entry->value = NULL;
+    t->count--;
+    return 1;
+}
 
-            Env* new_e = create_environment(func_exp->value.lambda.e);
-            data* params = func_exp->value.lambda.parameter;
-            while(params && arg_list && params->type == PAIR && arg_list->type == PAIR ) {
-                data* p = car(params);
-                void* vall = eval(car(arg_list), e);
-                add_elements_to_environment(new_e, p->value.symbol, vall);
-                params = cdr(params);
-                arg_list = cdr(arg_list);
-            }
-        
-            return eval(func_exp->value.lambda.body, new_e);
-        }
-        if (func_exp && func_exp->type == BUILT) {
-            if (strcmp(car(d)->value.symbol, "load") == 0) {
-                return func_exp->value.builtin.fn(cdr(d));
-            } else {
-                data* evaled = evaluate_list(cdr(d), e);
-                return func_exp->value.builtin.fn(evaled);
-            }
-        }
+data* create_hash_table_data(Interp* in, int equal_keys) {
+    HashTable* t = create_hash_table(in, equal_keys, 16);
+    if (t == NULL)
+        return NULL;
+    data* d = alloc_data(in, HASHTABLE);
+    d->value.table = t;
+    return d;
+}
 
+data* eq_builtin(Interp* in, int argc, data** argv) {
+    return create_int(in, eqv_data(argv[0], argv[1]));
+}
 
-        if (is_operator(first->value.symbol) && first && first->type == SYMBOL) {
-            data* arg_list = cdr(d);
-            if (strcmp(first->value.symbol, "+") == 0) {
-                data* result = create_rational(0, 1);
-                for (data* it = arg_list; it != NULL && it->type == PAIR; it = cdr(it)) {
-                    data* n = (data*) eval(car(it), e);
-                    data* r = to_rational(n);
-                    int a = result->value.rational.num;
-                    int b = result->value.rational.den;
-                    int c = r->value.rational.num;
-                    int d_ = r->value.rational.den;
-                    free_data(result);
-                    result = create_rational(a*d_ + b*c, b*d_);
-                    free_data(r);
-                }
-                return result;
-            } else if (strcmp(first->value.symbol, "-") == 0) {
-                if (arg_list == NULL || arg_list->type != PAIR) {
-                    printf("expected at least 1 argument for '-'\n");
-                    return NULL;
-                }
-                data* first_n = (data*) eval(car(arg_list), e);
-                data* result = to_rational(first_n);
-                data* it = cdr(arg_list);
-                if (it == NULL) {
-                    int a = result->value.rational.num;
-                    int b = result->value.rational.den;
-                    free_data(result);
-                    return create_rational(-a, b);
-                }
-                for (; it != NULL && it->type == PAIR; it = cdr(it)) {
-                    data* n = (data*) eval(car(it), e);
-                    data* r = to_rational(n);
-                    int a = result->value.rational.num;
-                    int b = result->value.rational.den;
-                    int c = r->value.rational.num;
-                    int d_ = r->value.rational.den;
-                    free_data(result);
-                    result = create_rational(a*d_ - b*c, b*d_);
-                    free_data(r);
-                }
-                return result;
-            } else if (strcmp(first->value.symbol, "*") == 0) {
-                data* result = create_rational(1, 1);
-                for (data* it = arg_list; it != NULL && it->type == PAIR; it = cdr(it)) {
-                    data* n = (data*) eval(car(it), e);
-                    data* r = to_rational(n);
-                    int a = result->value.rational.num;
-                    int b = result->value.rational.den;
-                    int c = r->value.rational.num;
-                    int d_ = r->value.rational.den;
-                    free_data(result);
-                    result = create_rational(a*c, b*d_);
-                    free_data(r);
-                }
-                return result;
-            } else if (strcmp(first->value.symbol, "/") == 0) {
-                if (arg_list == NULL || arg_list->type != PAIR) {
-                    printf("expected at least 2 arguments for '/'\n");
-                    return NULL;
-                }
-                data* first_n = (data*) eval(car(arg_list), e);
-                data* result = to_rational(first_n);
-                data* it = cdr(arg_list);
-                for (; it != NULL && it->type == PAIR; it = cdr(it)) {
-                    data* n = (data*) eval(car(it), e);
-                    data* r = to_rational(n);
-                    if (r->value.rational.num == 0) {
-                        printf("division by zero\n");
-                        free_data(r);
-                        free_data(result);
-                        return NULL;
-                    }
-                    int a = result->value.rational.num;
-                    int b = result->value.rational.den;
-                    int c = r->value.rational.num;
-                    int d_ = r->value.rational.den;
-                    free_data(result);
-                    result = create_rational(a*d_, b*c);
-                    free_data(r);
-                }
-                return result;
-            } else if (strcmp(first->value.symbol, "<") == 0 ||
-                    strcmp(first->value.symbol, ">") == 0 ||
-                    strcmp(first->value.symbol, "=") == 0) {
-                if (arg_list == NULL || cdr(arg_list) == NULL) {
-                    printf("expected at least 2 arguments for relational operator\n");
-                    return NULL;
-                }
-                int chain_result = 1;
-                data* prev_node = (data*) eval(car(arg_list), e);
-                double prev_val = 0;
-                if (prev_node->type == INTEGER)
-                    prev_val = prev_node->value.integer;
-                else if (prev_node->type == RATIONAL)
-                    prev_val = (double) prev_node->value.rational.num / prev_node->value.rational.den;
-                for (data* it = cdr(arg_list); it != NULL && it->type == PAIR; it = cdr(it)) {
-                    data* curr_node = (data*) eval(car(it), e);
-                    double curr_val = 0;
-                    if (curr_node->type == INTEGER)
-                        curr_val = curr_node->value.integer;
-                    else if (curr_node->type == RATIONAL)
-                        curr_val = (double) curr_node->value.rational.num / curr_node->value.rational.den;
-                    if (strcmp(first->value.symbol, "<") == 0) {
-                        if (!(prev_val < curr_val)) { chain_result = 0; break; }
-                    } else if (strcmp(first->value.symbol, ">") == 0) {
-                        if (!(prev_val > curr_val)) { chain_result = 0; break; }
-                    } else if (strcmp(first->value.symbol, "=") == 0) {
-                        if (!(prev_val == curr_val)) { chain_result = 0; break; }
-                    }
-                    prev_val = curr_val;
-                }
-                return create_int(chain_result);
-            } else if (strcmp(first->value.symbol, "and") == 0 ||
-                    strcmp(first->value.symbol, "or") == 0) {
-                if (arg_list == NULL || arg_list->type != PAIR) {
-                    printf("expected at least 1 argument for logical operator\n");
-                    return NULL;
-                }
-                int result;
-                if (strcmp(first->value.symbol, "and") == 0)
-                    result = 1;
-                else
-                    result = 0;
-                for (data* it = arg_list; it != NULL && it->type == PAIR; it = cdr(it)) {
-                    data* n = (data*) eval(car(it), e);
-                    int v = n->value.integer;
-                    if (strcmp(first->value.symbol, "and") == 0) {
-                        result = result && v;
-                    } else {
-                        result = result || v;
-                    }
-                }
-                return create_int(result);
-            }
+data* expect_hash_table(Interp* in, data* d, const char* who) {
+    if (d == NULL || d->type != HASHTABLE) {
+        report_error(in, "%s: expected hash table\n", who);
+        return NULL;
+    }
+    return d;
+}
+
+/* (make-hash-table), (make-hash-table equal?) or (make-hash-table eq?);
+   the symbols 'equal and 'eq are accepted as well. */
+data* make_hash_table_builtin(Interp* in, int argc, data** argv) {
+    int equal_keys = 1;
+    if (argc == 1) {
+        data* kind = argv[0];
+        if (kind != NULL && kind->type == BUILT && kind->value.builtin.fn == eq_builtin)
+            equal_keys = 0;
+        else if (kind != NULL && kind->type == SYMBOL && strcmp(kind->value.symbol, "eq") == 0)
+            equal_keys = 0;
+        else if (!(kind != NULL && kind->type == BUILT && kind->value.builtin.fn == equal_builtin) &&
+                 !(kind != NULL && kind->type == SYMBOL && strcmp(kind->value.symbol, "equal") == 0)) {
+            report_error(in, "make-hash-table: expected eq? or equal?\n");
             return NULL;
         }
+    }
+    return create_hash_table_data(in, equal_keys);
+}
 
+/* (hash-table-ref table key [default]) */
+data* hash_table_ref_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table-ref") == NULL)
         return NULL;
-    } else {
-        return NULL;
-    }
+    int found;
+    data* value = hash_table_get(argv[0]->value.table, argv[1], &found);
+    if (found)
+        return value;
+    if (argc == 3)
+        return argv[2];
+    report_error(in, "hash-table-ref: key not found\n");
+    return NULL;
 }
 
-data* parse_func(TokenList* tokens, int* ind);
+data* hash_table_set_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table-set!") == NULL)
+        return NULL;
+    if (!hash_table_put(in, argv[0]->value.table, argv[1], argv[2]))
+        return NULL;
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* hash_table_delete_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table-delete!") == NULL)
+        return NULL;
+    hash_table_remove(argv[0]->value.table, argv[1]);
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* hash_table_contains_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table-contains?") == NULL)
+        return NULL;
+    int found;
+    hash_table_get(argv[0]->value.table, argv[1], &found);
+    return create_int(in, found);
+}
+
+data* hash_table_count_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table-count") == NULL)
+        return NULL;
+    return create_int(in, argv[0]->value.table->count);
+}
+
+data* hash_table_p_builtin(Interp* in, int argc, data** argv) {
+    return create_int(in, argv[0] != NULL && argv[0]->type == HASHTABLE);
+}
+
+/* Collects the entries of a table into a fresh list: the keys (what = 0),
+   the values (what = 1) or (key . value) pairs (what = 2). */
+data* hash_table_list(Interp* in, data* table, int what) {
+    HashTable* t = table->value.table;
+    data* res = NULL;
+    for (int i = t->capacity - 1; i >= 0; i--) {
+        HashEntry* entry = &t->entries[i];
+        if (entry->state != SLOT_FULL)
+            continue;
+        data* item;
+        if (what == 0)
+            item = entry->key;
+        else if (what == 1)
+            item = entry->value;
+        else
+            item = create_pair(in, entry->key, entry->value);
+        res = create_pair(in, item, res);
+    }
+    return res;
+}
+
+data* hash_table_keys_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table-keys") == NULL)
+        return NULL;
+    return hash_table_list(in, argv[0], 0);
+}
+
+data* hash_table_values_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table-values") == NULL)
+        return NULL;
+    return hash_table_list(in, argv[0], 1);
+}
+
+data* hash_table_alist_builtin(Interp* in, int argc, data** argv) {
+    if (expect_hash_table(in, argv[0], "hash-table->alist") == NULL)
+        return NULL;
+    return hash_table_list(in, argv[0], 2);
+}
+
+
+/* Ports. read returns one datum at a time without evaluating it: tokens
+   are scanned from the port until they make up a complete datum, which is
+   then built by parse_func. The end of the input is the #<eof> symbol.
+   There is no character type, so read-char and peek-char return strings of
+   length one. */
+data* create_port(Interp* in, FILE* f, int input) {
+    Port* p = malloc(sizeof(Port));
+    p->f = f;
+    p->input = input;
+    p->buf = malloc(PORT_BUFFER_SIZE);
+    p->pos = 0;
+    p->len = 0;
+    if (!input)
+        setvbuf(f, p->buf, _IOFBF, PORT_BUFFER_SIZE);
+    data* d = alloc_data(in, PORT);
+    d->value.port = p;
+    return d;
+}
+
+void close_port(Port* p) {
+    if (p->f != NULL) {
+        fclose(p->f);
+        p->f = NULL;
+    }
+}
+
+data* eof_object(Interp* in) {
+    return create_symbol(in, "#<eof>");
+}
+
+/* The port argument argv[i], or NULL after reporting what is wrong with
+   it. With i past the arguments, output goes to stdout. */
+FILE* port_file(Interp* in, int argc, data** argv, int i, int input, const char* who) {
+    if (i >= argc && !input)
+        return stdout;
+    data* d = i < argc ? argv[i] : NULL;
+    if (d == NULL || d->type != PORT || d->value.port->input != input) {
+        report_error(in, "%s: expected %s port\n", who, input ? "an input" : "an output");
+        return NULL;
+    }
+    if (d->value.port->f == NULL) {
+        report_error(in, "%s: port is closed\n", who);
+        return NULL;
+    }
+    return d->value.port->f;
+}
+
+data* open_file(Interp* in, data* name, int input, const char* who) {
+    if (name == NULL || name->type != STRING) {
+        report_error(in, "%s: expected a file name\n", who);
+        return NULL;
+    }
+    FILE* f = fopen(name->value.string, input ? "r" : "w");
+    if (f == NULL) {
+        report_error(in, "%s: cannot open file %s\n", who, name->value.string);
+        return NULL;
+    }
+    return create_port(in, f, input);
+}
+
+data* open_input_file_builtin(Interp* in, int argc, data** argv) {
+    return open_file(in, argv[0], 1, "open-input-file");
+}
+
+data* open_output_file_builtin(Interp* in, int argc, data** argv) {
+    return open_file(in, argv[0], 0, "open-output-file");
+}
+
+data* close_port_builtin(Interp* in, int argc, data** argv) {
+    if (argv[0] == NULL || argv[0]->type != PORT) {
+        report_error(in, "close-port: expected a port\n");
+        return NULL;
+    }
+    close_port(argv[0]->value.port);
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* read_builtin(Interp* in, int argc, data** argv) {
+    if (port_file(in, argc, argv, 0, 1, "read") == NULL)
+        return NULL;
+    Port* p = argv[0]->value.port;
+    TokenList* t_list = create_list_of_tokens();
+    TokenBuf tok = { NULL, 0, 0 };
+    int depth = 0;
+    int r;
+    while ((r = next_token(p, &tok)) > 0) {
+        add_token(t_list, tok.text);
+        if (strcmp(tok.text, "(") == 0)
+            depth++;
+        else if (strcmp(tok.text, ")") == 0)
+            depth--;
+        if (depth <= 0 && strcmp(tok.text, "'") != 0)
+            break;
+    }
+    free(tok.text);
+    data* result = NULL;
+    if (r == 0 && t_list->log_len == 0) {
+        result = eof_object(in);
+    } else if (r == 0 && depth > 0) {
+        scheme_error(in, "read: unexpected end of file");
+    } else {
+        int pos = 0;
+        int ok = 1;
+        result = parse_datum(in, t_list, &pos, &ok);
+        if (!ok)
+            scheme_error(in, "read: malformed datum");
+    }
+    free_token_list(t_list);
+    return result;
+}
+
+/* Next byte of an input port without consuming it, or EOF. */
+int port_peek(Port* p) {
+    if (p->pos >= p->len && !refill_port(p))
+        return EOF;
+    return (unsigned char) p->buf[p->pos];
+}
+
+data* char_string(Interp* in, int c) {
+    char s[2] = { (char) c, '\0' };
+    return create_string(in, s);
+}
+
+data* read_char_builtin(Interp* in, int argc, data** argv) {
+    if (port_file(in, argc, argv, 0, 1, "read-char") == NULL)
+        return NULL;
+    Port* p = argv[0]->value.port;
+    int c = port_peek(p);
+    if (c == EOF)
+        return eof_object(in);
+    p->pos++;
+    return char_string(in, c);
+}
+
+data* peek_char_builtin(Interp* in, int argc, data** argv) {
+    if (port_file(in, argc, argv, 0, 1, "peek-char") == NULL)
+        return NULL;
+    int c = port_peek(argv[0]->value.port);
+    return c == EOF ? eof_object(in) : char_string(in, c);
+}
+
+data* read_line_builtin(Interp* in, int argc, data** argv) {
+    if (port_file(in, argc, argv, 0, 1, "read-line") == NULL)
+        return NULL;
+    Port* p = argv[0]->value.port;
+    if (port_peek(p) == EOF)
+        return eof_object(in);
+    TokenBuf line = { NULL, 0, 0 };
+    token_append(&line, "", 0);
+    while (port_peek(p) != EOF) {
+        char* nl = memchr(p->buf + p->pos, '\n', p->len - p->pos);
+        size_t end = nl ? (size_t) (nl - p->buf) : p->len;
+        token_append(&line, p->buf + p->pos, end - p->pos);
+        p->pos = end;
+        if (nl) {
+            p->pos++;
+            break;
+        }
+    }
+    data* result = create_string(in, line.text);
+    free(line.text);
+    return result;
+}
+
+data* write_builtin(Interp* in, int argc, data** argv) {
+    FILE* out = port_file(in, argc, argv, 1, 0, "write");
+    if (out == NULL)
+        return NULL;
+    write_data(out, argv[0], 0);
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* display_builtin(Interp* in, int argc, data** argv) {
+    FILE* out = port_file(in, argc, argv, 1, 0, "display");
+    if (out == NULL)
+        return NULL;
+    write_data(out, argv[0], 1);
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* newline_builtin(Interp* in, int argc, data** argv) {
+    FILE* out = port_file(in, argc, argv, 0, 0, "newline");
+    if (out == NULL)
+        return NULL;
+    fputc('\n', out);
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* eof_object_p_builtin(Interp* in, int argc, data** argv) {
+    data* d = argv[0];
+    return create_int(in, d != NULL && d->type == SYMBOL && strcmp(d->value.symbol, "#<eof>") == 0);
+}
+
+/* Promises and streams. (delay exp) and (cons-stream a b) capture exp or b
+   with their environment; force evaluates it once and remembers the value.
+   A promise made by (delay-force exp), where exp yields another promise,
+   takes over that promise's expression when forced instead of forcing it
+   recursively, so long chains of delayed tail calls run in constant space.
+   force and stream-cdr are run by the evaluator itself; the builtins below
+   are for calls through call_builtin. */
+data* create_promise(Interp* in, data* exp, Env* e, int lazy) {
+    data* d = alloc_data(in, PROMISE);
+    d->value.promise.exp = exp;
+    d->value.promise.e = e;
+    d->value.promise.result = NULL;
+    d->value.promise.done = 0;
+    d->value.promise.lazy = lazy;
+    return d;
+}
+
+/* Records r, the value of p's expression. Returns 0 when p came from
+   delay-force and r is a pending promise: p then holds r's expression,
+   which has to be evaluated next. */
+int settle_promise(data* p, data* r) {
+    if (p->value.promise.done)
+        return 1;   /* forced again while its expression was running */
+    if (p->value.promise.lazy && r != NULL && r->type == PROMISE) {
+        if (!r->value.promise.done) {
+            p->value.promise.exp = r->value.promise.exp;
+            p->value.promise.e = r->value.promise.e;
+            p->value.promise.lazy = r->value.promise.lazy;
+            return 0;
+        }
+        r = r->value.promise.result;
+    }
+    p->value.promise.done = 1;
+    p->value.promise.result = r;
+    p->value.promise.exp = NULL;
+    p->value.promise.e = NULL;
+    return 1;
+}
+
+data* force_promise(Interp* in, data* p) {
+    if (p == NULL || p->type != PROMISE)
+        return p;
+    while (!p->value.promise.done) {
+        data* r = (data*) eval(in, p->value.promise.exp, p->value.promise.e);
+        if (in->error != NULL)
+            return NULL;
+        settle_promise(p, r);
+    }
+    return p->value.promise.result;
+}
+
+data* force_builtin(Interp* in, int argc, data** argv) {
+    return force_promise(in, argv[0]);
+}
+
+data* make_promise_builtin(Interp* in, int argc, data** argv) {
+    if (argv[0] != NULL && argv[0]->type == PROMISE)
+        return argv[0];
+    data* p = create_promise(in, NULL, NULL, 0);
+    settle_promise(p, argv[0]);
+    return p;
+}
+
+data* promise_p_builtin(Interp* in, int argc, data** argv) {
+    return create_int(in, argv[0] != NULL && argv[0]->type == PROMISE);
+}
+
+data* stream_car_builtin(Interp* in, int argc, data** argv) {
+    if (argv[0] == NULL || argv[0]->type != PAIR) {
+        report_error(in, "stream-car: expected stream\n");
+        return NULL;
+    }
+    return car(argv[0]);
+}
+
+data* stream_cdr_builtin(Interp* in, int argc, data** argv) {
+    if (argv[0] == NULL || argv[0]->type != PAIR) {
+        report_error(in, "stream-cdr: expected stream\n");
+        return NULL;
+    }
+    return force_promise(in, cdr(argv[0]));
+}
+
+data* stream_pair_p_builtin(Interp* in, int argc, data** argv) {
+    data* s = argv[0];
+    return create_int(in, s != NULL && s->type == PAIR && cdr(s) != NULL && cdr(s)->type == PROMISE);
+}
+
+/* The rest of the stream library, written in Scheme and evaluated by every
+   new interpreter. */
+const char* stream_prelude =
+    "(define (stream-map f s)"
+    "  (if (null? s) '() (cons-stream (f (stream-car s)) (stream-map f (stream-cdr s)))))"
+    "(define (stream-filter keep? s)"
+    "  (if (null? s) '()"
+    "      (if (keep? (stream-car s))"
+    "          (cons-stream (stream-car s) (stream-filter keep? (stream-cdr s)))"
+    "          (stream-filter keep? (stream-cdr s)))))"
+    "(define (stream-take n s)"
+    "  (if (if (= n 0) 1 (null? s)) '()"
+    "      (cons-stream (stream-car s) (stream-take (- n 1) (stream-cdr s)))))"
+    "(define (stream-ref s n)"
+    "  (if (= n 0) (stream-car s) (stream-ref (stream-cdr s) (- n 1))))"
+    "(define (stream->list s)"
+    "  (if (null? s) '() (cons (stream-car s) (stream->list (stream-cdr s)))))";
+
+/* Only the integer 0 and the symbol #f are false. */
+int is_truthy(data* cond) {
+    if (cond && cond->type == INTEGER && cond->value.integer == 0)
+        return 0;
+    if (cond && cond->type == SYMBOL && strcmp(cond->value.symbol, "#f") == 0)
+        return 0;
+    return 1;
+}
+
+/* List operations. The ones taking a procedure call it through
+   apply_procedure with the arguments pushed on the argument buffer, so no
+   application forms are built. Everything they hold across such a call
+   (cursors, partial results) lives in the argument buffer as well, where
+   the collector sees it; they index the buffer instead of keeping argv,
+   which moves when the buffer grows. */
+
+/* Pops the values from base up into a fresh list, in order. */
+data* list_from_args(Interp* in, int base) {
+    data* list = create_list(in, in->args + base, in->args_len - base, NULL);
+    in->args_len = base;
+    return list;
+}
+
+/* Pushes the cars of the n lists at in->args[at..at+n) and advances them.
+   Returns 0, pushing nothing, once any of them has run out. */
+int push_cars(Interp* in, int at, int n) {
+    for (int i = 0; i < n; i++) {
+        if (in->args[at + i] == NULL || in->args[at + i]->type != PAIR)
+            return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        push_arg(in, car(in->args[at + i]));
+        in->args[at + i] = cdr(in->args[at + i]);
+    }
+    return 1;
+}
+
+/* (map f list ...). Calls with one list are run by the evaluator itself. */
+data* map_builtin(Interp* in, int argc, data** argv) {
+    int at = argv - in->args;
+    int base = in->args_len;
+    while (push_cars(in, at + 1, argc - 1)) {
+        data* v = apply_procedure(in, in->args[at], argc - 1);
+        if (in->error != NULL)
+            return NULL;
+        push_arg(in, v);
+    }
+    return list_from_args(in, base);
+}
+
+data* for_each_builtin(Interp* in, int argc, data** argv) {
+    int at = argv - in->args;
+    while (push_cars(in, at + 1, argc - 1)) {
+        apply_procedure(in, in->args[at], argc - 1);
+        if (in->error != NULL)
+            return NULL;
+    }
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* filter_builtin(Interp* in, int argc, data** argv) {
+    int at = argv - in->args;
+    int base = in->args_len;
+    for (data* it = argv[1]; it != NULL && it->type == PAIR; it = cdr(it)) {
+        push_arg(in, car(it));
+        data* keep = apply_procedure(in, in->args[at], 1);
+        if (in->error != NULL)
+            return NULL;
+        if (keep != NULL && is_truthy(keep))
+            push_arg(in, car(it));
+    }
+    return list_from_args(in, base);
+}
+
+/* (fold-left f init list ...) computes (f (f init a0 b0 ...) a1 b1 ...). */
+data* fold_left_builtin(Interp* in, int argc, data** argv) {
+    int at = argv - in->args;
+    int n = argc - 2;
+    while (1) {
+        push_arg(in, in->args[at + 1]);
+        if (!push_cars(in, at + 2, n)) {
+            in->args_len--;
+            break;
+        }
+        data* acc = apply_procedure(in, in->args[at], n + 1);
+        if (in->error != NULL)
+            return NULL;
+        in->args[at + 1] = acc;
+    }
+    return in->args[at + 1];
+}
+
+/* (fold-right f init list ...) computes (f a0 b0 ... (f a1 b1 ... init)).
+   The elements are first pushed in order, then combined from the end. */
+data* fold_right_builtin(Interp* in, int argc, data** argv) {
+    int at = argv - in->args;
+    int n = argc - 2;
+    int base = in->args_len;
+    while (push_cars(in, at + 2, n))
+        ;
+    for (int i = in->args_len - n; i >= base; i -= n) {
+        for (int j = 0; j < n; j++)
+            push_arg(in, in->args[i + j]);
+        push_arg(in, in->args[at + 1]);
+        data* acc = apply_procedure(in, in->args[at], n + 1);
+        if (in->error != NULL)
+            return NULL;
+        in->args[at + 1] = acc;
+    }
+    in->args_len = base;
+    return in->args[at + 1];
+}
+
+/* (reduce f initial list): initial for an empty list, otherwise the
+   elements combined left to right as (f element accumulated). */
+data* reduce_builtin(Interp* in, int argc, data** argv) {
+    int at = argv - in->args;
+    data* list = argv[2];
+    if (list == NULL || list->type != PAIR)
+        return argv[1];
+    in->args[at + 1] = car(list);
+    for (data* it = cdr(list); it != NULL && it->type == PAIR; it = cdr(it)) {
+        push_arg(in, car(it));
+        push_arg(in, in->args[at + 1]);
+        data* acc = apply_procedure(in, in->args[at], 2);
+        if (in->error != NULL)
+            return NULL;
+        in->args[at + 1] = acc;
+    }
+    return in->args[at + 1];
+}
+
+/* (assoc key alist) is the first pair whose car is equal? to key, or 0. */
+data* assoc_builtin(Interp* in, int argc, data** argv) {
+    for (data* it = argv[1]; it != NULL && it->type == PAIR; it = cdr(it)) {
+        data* entry = car(it);
+        if (entry != NULL && entry->type == PAIR && equal_data(car(entry), argv[0]))
+            return entry;
+    }
+    return create_int(in, 0);
+}
+
+/* (member x list) is the first tail of list starting with x, or 0. */
+data* member_builtin(Interp* in, int argc, data** argv) {
+    for (data* it = argv[1]; it != NULL && it->type == PAIR; it = cdr(it)) {
+        if (equal_data(car(it), argv[0]))
+            return it;
+    }
+    return create_int(in, 0);
+}
+
+data* reverse_builtin(Interp* in, int argc, data** argv) {
+    data* result = NULL;
+    for (data* it = argv[0]; it != NULL && it->type == PAIR; it = cdr(it))
+        result = create_pair(in, car(it), result);
+    return result;
+}
+
+data* list_tail_builtin(Interp* in, int argc, data** argv) {
+    data* list = argv[0];
+    if (argv[1] == NULL || argv[1]->type != INTEGER || argv[1]->value.integer < 0) {
+        report_error(in, "list-tail: expected a non-negative integer\n");
+        return NULL;
+    }
+    for (int k = argv[1]->value.integer; k > 0; k--) {
+        if (list == NULL || list->type != PAIR) {
+            report_error(in, "list-tail: list too short\n");
+            return NULL;
+        }
+        list = cdr(list);
+    }
+    return list;
+}
+
+/* (sort list less?). Bottom-up merge sort over two runs of the argument
+   buffer; on ties the element from the left run is taken first, so the
+   sort is stable. */
+data* sort_builtin(Interp* in, int argc, data** argv) {
+    int at = argv - in->args;
+    int src = in->args_len;
+    int n = 0;
+    for (data* it = argv[0]; it != NULL && it->type == PAIR; it = cdr(it), n++)
+        push_arg(in, car(it));
+    int dst = in->args_len;
+    for (int i = 0; i < n; i++)
+        push_arg(in, NULL);
+    for (int width = 1; width < n; width *= 2) {
+        for (int lo = 0; lo < n; lo += 2 * width) {
+            int mid = lo + width < n ? lo + width : n;
+            int hi = lo + 2 * width < n ? lo + 2 * width : n;
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                push_arg(in, in->args[src + j]);
+                push_arg(in, in->args[src + i]);
+                data* less = apply_procedure(in, in->args[at + 1], 2);
+                if (in->error != NULL)
+                    return NULL;
+                if (less != NULL && is_truthy(less))
+                    in->args[dst + k++] = in->args[src + j++];
+                else
+                    in->args[dst + k++] = in->args[src + i++];
+            }
+            while (i < mid)
+                in->args[dst + k++] = in->args[src + i++];
+            while (j < hi)
+                in->args[dst + k++] = in->args[src + j++];
+        }
+        int t = src;
+        src = dst;
+        dst = t;
+    }
+    data* result = NULL;
+    for (int i = n - 1; i >= 0; i--)
+        result = create_pair(in, in->args[src + i], result);
+    in->args_len = at + argc;
+    return result;
+}
+
+
+/* Records. (define-record-type name (constructor field ...) predicate
+   (field accessor [modifier]) ...) binds name to a type descriptor, the
+   list (name field ...), and the procedures to native builtins. A record
+   holds its descriptor and an array with one slot per field, so the
+   accessors check the type once and index the slot directly. Each of
+   these builtins keeps (procedure-name descriptor . details) in its info,
+   which it reaches through in->callee. */
+data* create_record(Interp* in, data* type, int count) {
+    if (!account_bytes(in, count * sizeof(data*)))
+        return NULL;
+    data* d = alloc_data(in, RECORD);
+    d->value.record.type = type;
+    d->value.record.count = count;
+    d->value.record.slots = calloc(count > 0 ? count : 1, sizeof(data*));
+    return d;
+}
+
+data* record_info(Interp* in) {
+    return cdr(in->callee->value.builtin.info);
+}
+
+data* expect_record(Interp* in, data* d) {
+    data* type = car(record_info(in));
+    if (d == NULL || d->type != RECORD || d->value.record.type != type) {
+        report_error(in, "%s: expected %s\n", in->callee->value.builtin.name, car(type)->value.symbol);
+        return NULL;
+    }
+    return d;
+}
+
+/* details: the slot of each argument */
+data* record_constructor_builtin(Interp* in, int argc, data** argv) {
+    data* info = record_info(in);
+    data* type = car(info);
+    data* r = create_record(in, type, list_length(cdr(type)));
+    if (r == NULL)
+        return NULL;
+    data* slot = cdr(info);
+    for (int i = 0; i < argc; i++, slot = cdr(slot))
+        r->value.record.slots[car(slot)->value.integer] = argv[i];
+    return r;
+}
+
+data* record_predicate_builtin(Interp* in, int argc, data** argv) {
+    data* type = car(record_info(in));
+    return create_int(in, argv[0] != NULL && argv[0]->type == RECORD &&
+                          argv[0]->value.record.type == type);
+}
+
+/* details: the slot */
+data* record_accessor_builtin(Interp* in, int argc, data** argv) {
+    data* r = expect_record(in, argv[0]);
+    if (r == NULL)
+        return NULL;
+    return r->value.record.slots[car(cdr(record_info(in)))->value.integer];
+}
+
+data* record_modifier_builtin(Interp* in, int argc, data** argv) {
+    data* r = expect_record(in, argv[0]);
+    if (r == NULL)
+        return NULL;
+    r->value.record.slots[car(cdr(record_info(in)))->value.integer] = argv[1];
+    return create_symbol(in, "#<unspecified>");
+}
+
+void bind_record_procedure(Interp* in, Env* e, data* name, builtin_fn fn, int argc,
+                           data* type, data* details) {
+    data* f = create_builtin(in, name->value.symbol, fn, argc, argc);
+    f->value.builtin.info = create_pair(in, name, create_pair(in, type, details));
+    define_variable(in, e, name->value.symbol, f);
+}
+
+int field_index(data* fields, data* name) {
+    int i = 0;
+    for (data* it = fields; it != NULL; it = cdr(it), i++) {
+        if (strcmp(car(it)->value.symbol, name->value.symbol) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Evaluates a define-record-type form x in e. Nothing here calls back into
+   the evaluator, so the values made along the way need no protection. */
+data* define_record_type(Interp* in, data* x, Env* e) {
+    data* name = car(cdr(x));
+    data* constructor = car(cdr(cdr(x)));
+    data* predicate = car(cdr(cdr(cdr(x))));
+    data* specs = cdr(cdr(cdr(cdr(x))));
+    if (name == NULL || name->type != SYMBOL || constructor == NULL || constructor->type != PAIR ||
+        car(constructor) == NULL || car(constructor)->type != SYMBOL ||
+        predicate == NULL || predicate->type != SYMBOL) {
+        report_error(in, "define-record-type: bad syntax\n");
+        return NULL;
+    }
+    int base = in->args_len;
+    for (data* it = specs; it != NULL; it = cdr(it)) {
+        data* spec = car(it);
+        if (spec == NULL || spec->type != PAIR || car(spec) == NULL || car(spec)->type != SYMBOL ||
+            car(cdr(spec)) == NULL || car(cdr(spec))->type != SYMBOL) {
+            report_error(in, "define-record-type: bad field\n");
+            in->args_len = base;
+            return NULL;
+        }
+        push_arg(in, car(spec));
+    }
+    data* type = create_pair(in, name, list_from_args(in, base));
+    data* fields = cdr(type);
+
+    for (data* it = cdr(constructor); it != NULL; it = cdr(it)) {
+        int slot = car(it) != NULL && car(it)->type == SYMBOL ? field_index(fields, car(it)) : -1;
+        if (slot < 0) {
+            report_error(in, "define-record-type: ");
+            print_data(car(it));
+            printf(" is not a field\n");
+            in->args_len = base;
+            return NULL;
+        }
+        push_arg(in, create_int(in, slot));
+    }
+    int argc = in->args_len - base;
+    define_variable(in, e, name->value.symbol, type);
+    bind_record_procedure(in, e, car(constructor), record_constructor_builtin, argc,
+                          type, list_from_args(in, base));
+    bind_record_procedure(in, e, predicate, record_predicate_builtin, 1, type, NULL);
+    int slot = 0;
+    for (data* it = specs; it != NULL; it = cdr(it), slot++) {
+        data* accessor = car(cdr(car(it)));
+        data* modifier = car(cdr(cdr(car(it))));
+        bind_record_procedure(in, e, accessor, record_accessor_builtin, 1, type,
+                              create_pair(in, create_int(in, slot), NULL));
+        if (modifier != NULL && modifier->type == SYMBOL)
+            bind_record_procedure(in, e, modifier, record_modifier_builtin, 2, type,
+                                  create_pair(in, create_int(in, slot), NULL));
+    }
+    return create_symbol(in, "#<unspecified>");
+}
+
+/* Bytevectors. Raw bytes in one block, indexed in O(1). (mmap-file path)
+   maps a file read-only and wraps the mapping without copying it; the
+   mapping is removed when the bytevector is collected. Multi-byte reads
+   use the machine's byte order and need no alignment. */
+data* create_bytevector(Interp* in, size_t length) {
+    if (!account_bytes(in, length))
+        return NULL;
+    unsigned char* bytes = calloc(length > 0 ? length : 1, 1);
+    if (bytes == NULL) {
+        /* within the limit but more than the system has */
+        in->bytes_since_gc -= length;
+        in->bytes_allocated -= length;
+        scheme_error(in, "allocation limit exceeded");
+        return NULL;
+    }
+    data* d = alloc_data(in, BYTEVECTOR);
+    d->value.bytevector.bytes = bytes;
+    d->value.bytevector.length = length;
+    d->value.bytevector.mapped = 0;
+    return d;
+}
+
+data* expect_bytevector(Interp* in, data* d, const char* who) {
+    if (d == NULL || d->type != BYTEVECTOR) {
+        report_error(in, "%s: expected bytevector\n", who);
+        return NULL;
+    }
+    return d;
+}
+
+/* Checks that k is an index with width bytes of bv from it on. Indices
+   past INT_MAX are only written inexactly, so integral floats count too. */
+int byte_offset(Interp* in, data* bv, data* k, size_t width, const char* who, size_t* out) {
+    double i = -1;
+    if (k != NULL && k->type == INTEGER)
+        i = k->value.integer;
+    else if (k != NULL && k->type == FLOAT && k->value.floating == floor(k->value.floating))
+        i = k->value.floating;
+    if (i < 0 || i + width > (double) bv->value.bytevector.length) {
+        report_error(in, "%s: index out of range\n", who);
+        return 0;
+    }
+    *out = (size_t) i;
+    return 1;
+}
+
+/* A length or index, inexact once it is past the exact integer range. */
+data* create_size(Interp* in, size_t n) {
+    return n <= INT_MAX ? create_int(in, (int) n) : create_float(in, (double) n);
+}
+
+int byte_value(Interp* in, data* b, const char* who) {
+    if (b == NULL || b->type != INTEGER || b->value.integer < 0 || b->value.integer > 255) {
+        report_error(in, "%s: expected a byte\n", who);
+        return -1;
+    }
+    return b->value.integer;
+}
+
+/* Reads the optional [start [end]] arguments at argv[i] into a range of bv. */
+int byte_range(Interp* in, data* bv, int argc, data** argv, int i, const char* who, size_t* start, size_t* end) {
+    *start = 0;
+    *end = bv->value.bytevector.length;
+    if (i < argc && !byte_offset(in, bv, argv[i], 0, who, start))
+        return 0;
+    if (i + 1 < argc && !byte_offset(in, bv, argv[i + 1], 0, who, end))
+        return 0;
+    if (*end < *start) {
+        report_error(in, "%s: end before start\n", who);
+        return 0;
+    }
+    return 1;
+}
+
+data* make_bytevector_builtin(Interp* in, int argc, data** argv) {
+    if (argv[0] == NULL || argv[0]->type != INTEGER || argv[0]->value.integer < 0) {
+        report_error(in, "make-bytevector: expected a length\n");
+        return NULL;
+    }
+    int fill = argc > 1 ? byte_value(in, argv[1], "make-bytevector") : 0;
+    if (fill < 0)
+        return NULL;
+    data* bv = create_bytevector(in, (size_t) argv[0]->value.integer);
+    if (bv == NULL)
+        return NULL;
+    memset(bv->value.bytevector.bytes, fill, bv->value.bytevector.length);
+    return bv;
+}
+
+data* bytevector_builtin(Interp* in, int argc, data** argv) {
+    for (int i = 0; i < argc; i++) {
+        if (byte_value(in, argv[i], "bytevector") < 0)
+            return NULL;
+    }
+    data* bv = create_bytevector(in, argc);
+    if (bv == NULL)
+        return NULL;
+    for (int i = 0; i < argc; i++)
+        bv->value.bytevector.bytes[i] = (unsigned char) argv[i]->value.integer;
+    return bv;
+}
+
+data* bytevector_p_builtin(Interp* in, int argc, data** argv) {
+    return create_int(in, argv[0] != NULL && argv[0]->type == BYTEVECTOR);
+}
+
+data* bytevector_length_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-length");
+    return bv ? create_size(in, bv->value.bytevector.length) : NULL;
+}
+
+data* bytevector_u8_ref_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-u8-ref");
+    size_t k;
+    if (bv == NULL || !byte_offset(in, bv, argv[1], 1, "bytevector-u8-ref", &k))
+        return NULL;
+    return create_int(in, bv->value.bytevector.bytes[k]);
+}
+
+data* bytevector_u8_set_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-u8-set!");
+    size_t k;
+    if (bv == NULL || !byte_offset(in, bv, argv[1], 1, "bytevector-u8-set!", &k))
+        return NULL;
+    if (bv->value.bytevector.mapped) {
+        report_error(in, "bytevector-u8-set!: bytevector is read-only\n");
+        return NULL;
+    }
+    int b = byte_value(in, argv[2], "bytevector-u8-set!");
+    if (b < 0)
+        return NULL;
+    bv->value.bytevector.bytes[k] = (unsigned char) b;
+    return create_symbol(in, "#<unspecified>");
+}
+
+data* bytevector_u16_native_ref_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-u16-native-ref");
+    size_t k;
+    if (bv == NULL || !byte_offset(in, bv, argv[1], 2, "bytevector-u16-native-ref", &k))
+        return NULL;
+    uint16_t v;
+    memcpy(&v, bv->value.bytevector.bytes + k, sizeof(v));
+    return create_int(in, v);
+}
+
+data* bytevector_s32_native_ref_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-s32-native-ref");
+    size_t k;
+    if (bv == NULL || !byte_offset(in, bv, argv[1], 4, "bytevector-s32-native-ref", &k))
+        return NULL;
+    int32_t v;
+    memcpy(&v, bv->value.bytevector.bytes + k, sizeof(v));
+    return create_int(in, v);
+}
+
+/* Values above the exact integer range come back inexact. */
+data* bytevector_u32_native_ref_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-u32-native-ref");
+    size_t k;
+    if (bv == NULL || !byte_offset(in, bv, argv[1], 4, "bytevector-u32-native-ref", &k))
+        return NULL;
+    uint32_t v;
+    memcpy(&v, bv->value.bytevector.bytes + k, sizeof(v));
+    return create_size(in, v);
+}
+
+/* (bytevector-copy bv [start [end]]) */
+data* bytevector_copy_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-copy");
+    size_t start, end;
+    if (bv == NULL || !byte_range(in, bv, argc, argv, 1, "bytevector-copy", &start, &end))
+        return NULL;
+    data* copy = create_bytevector(in, end - start);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy->value.bytevector.bytes, bv->value.bytevector.bytes + start, end - start);
+    return copy;
+}
+
+/* (bytevector-copy! to at from [start [end]]); the ranges may overlap. */
+data* bytevector_copy_to_builtin(Interp* in, int argc, data** argv) {
+    data* to = expect_bytevector(in, argv[0], "bytevector-copy!");
+    data* from = expect_bytevector(in, argv[2], "bytevector-copy!");
+    size_t at, start, end;
+    if (to == NULL || from == NULL ||
+        !byte_range(in, from, argc, argv, 3, "bytevector-copy!", &start, &end) ||
+        !byte_offset(in, to, argv[1], end - start, "bytevector-copy!", &at))
+        return NULL;
+    if (to->value.bytevector.mapped) {
+        report_error(in, "bytevector-copy!: bytevector is read-only\n");
+        return NULL;
+    }
+    memmove(to->value.bytevector.bytes + at, from->value.bytevector.bytes + start, end - start);
+    return create_symbol(in, "#<unspecified>");
+}
+
+/* (bytevector-index bv byte [start [end]]) is the position of the first
+   byte equal to byte in the range, or -1. */
+data* bytevector_index_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "bytevector-index");
+    int b = byte_value(in, argv[1], "bytevector-index");
+    size_t start, end;
+    if (bv == NULL || b < 0 || !byte_range(in, bv, argc, argv, 2, "bytevector-index", &start, &end))
+        return NULL;
+    unsigned char* bytes = bv->value.bytevector.bytes;
+    unsigned char* hit = memchr(bytes + start, b, end - start);
+    return hit ? create_size(in, hit - bytes) : create_int(in, -1);
+}
+
+/* (utf8->string bv [start [end]]); the string ends at a zero byte. */
+data* utf8_to_string_builtin(Interp* in, int argc, data** argv) {
+    data* bv = expect_bytevector(in, argv[0], "utf8->string");
+    size_t start, end;
+    if (bv == NULL || !byte_range(in, bv, argc, argv, 1, "utf8->string", &start, &end))
+        return NULL;
+    char* s = malloc(end - start + 1);
+    memcpy(s, bv->value.bytevector.bytes + start, end - start);
+    s[end - start] = '\0';
+    data* d = create_string(in, s);
+    free(s);
+    return d;
+}
+
+data* string_to_utf8_builtin(Interp* in, int argc, data** argv) {
+    if (argv[0] == NULL || argv[0]->type != STRING) {
+        report_error(in, "string->utf8: expected string\n");
+        return NULL;
+    }
+    size_t n = strlen(argv[0]->value.string);
+    data* bv = create_bytevector(in, n);
+    if (bv == NULL)
+        return NULL;
+    memcpy(bv->value.bytevector.bytes, argv[0]->value.string, n);
+    return bv;
+}
+
+data* mmap_file_builtin(Interp* in, int argc, data** argv) {
+    if (argv[0] == NULL || argv[0]->type != STRING) {
+        report_error(in, "mmap-file: expected a file name\n");
+        return NULL;
+    }
+    int fd = open(argv[0]->value.string, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report_error(in, "mmap-file: cannot open file %s\n", argv[0]->value.string);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    /* mmap takes no empty mappings; an empty file gets an empty vector
+       that is read-only all the same */
+    if (st.st_size == 0) {
+        close(fd);
+        data* bv = create_bytevector(in, 0);
+        if (bv != NULL)
+            bv->value.bytevector.mapped = 1;
+        return bv;
+    }
+    void* bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        report_error(in, "mmap-file: cannot map file %s\n", argv[0]->value.string);
+        return NULL;
+    }
+    data* bv = alloc_data(in, BYTEVECTOR);
+    bv->value.bytevector.bytes = bytes;
+    bv->value.bytevector.length = st.st_size;
+    bv->value.bytevector.mapped = 1;
+    return bv;
+}
+
+/* Memoization. (memoize proc [capacity]) returns a procedure that caches
+   proc's results by argument list: a hash table on the same structural
+   hash as equal hash tables, whose entries are also kept in
+   least-recently-used order so the oldest one is dropped once there are
+   more than capacity. (define-memoized (name . params) body) defines a
+   memoized procedure, so its recursive calls go through the cache too.
+   The memoized procedure is a builtin whose info is the MEMO table; the
+   evaluator handles its calls itself. */
+#define MEMO_DEFAULT_CAPACITY 4096
+
+typedef struct MemoEntry {
+    data* key;                  /* the argument list */
+    data* value;
+    unsigned int hash;
+    struct MemoEntry* chain;    /* next in the bucket */
+    struct MemoEntry* newer;
+    struct MemoEntry* older;
+} MemoEntry;
+
+struct Memo {
+    data* proc;
+    int capacity;
+    int count;
+    long hits;
+    long misses;
+    int n_buckets;              /* a power of two */
+    MemoEntry** buckets;
+    MemoEntry* newest;
+    MemoEntry* oldest;
+};
+
+data* memoized_builtin(Interp* in, int argc, data** argv);
+
+data* create_memoized(Interp* in, data* proc, int capacity) {
+    if (!account_bytes(in, 16 * sizeof(MemoEntry*)))
+        return NULL;
+    Memo* m = malloc(sizeof(Memo));
+    m->proc = proc;
+    m->capacity = capacity;
+    m->count = 0;
+    m->hits = 0;
+    m->misses = 0;
+    m->n_buckets = 16;
+    m->buckets = calloc(m->n_buckets, sizeof(MemoEntry*));
+    m->newest = NULL;
+    m->oldest = NULL;
+    data* table = alloc_data(in, MEMO);
+    table->value.memo = m;
+    data* f = create_builtin(in, "memoized procedure", memoized_builtin, 0, -1);
+    f->value.builtin.info = table;
+    return f;
+}
+
+void free_memo(Memo* m) {
+    for (MemoEntry* e = m->newest; e != NULL; ) {
+        MemoEntry* older = e->older;
+        free(e);
+        e = older;
+    }
+    free(m->buckets);
+    free(m);
+}
+
+/* hash_data of the list of the argc arguments, without making the list */
+unsigned int memo_hash(data** argv, int argc) {
+    if (argc == 0)
+        return hash_data(NULL, 1);
+    unsigned int h = 0x811c9dc5u;
+    for (int i = 0; i < argc; i++)
+        h = mix_hash(h, hash_data(argv[i], 1));
+    return mix_hash(h, hash_data(NULL, 1));
+}
+
+void memo_unlink(Memo* m, MemoEntry* e) {
+    if (e->newer) e->newer->older = e->older; else m->newest = e->older;
+    if (e->older) e->older->newer = e->newer; else m->oldest = e->newer;
+}
+
+void memo_push_newest(Memo* m, MemoEntry* e) {
+    e->newer = NULL;
+    e->older = m->newest;
+    if (m->newest) m->newest->newer = e; else m->oldest = e;
+    m->newest = e;
+}
+
+/* Finds the entry for the arguments and counts a hit or a miss. */
+MemoEntry* memo_find(Memo* m, data** argv, int argc, unsigned int hash) {
+    for (MemoEntry* e = m->buckets[hash & (m->n_buckets - 1)]; e != NULL; e = e->chain) {
+        if (e->hash != hash)
+            continue;
+        data* key = e->key;
+        int i = 0;
+        for (; i < argc && key != NULL && equal_data(car(key), argv[i]); i++)
+            key = cdr(key);
+        if (i == argc && key == NULL) {
+            m->hits++;
+            memo_unlink(m, e);
+            memo_push_newest(m, e);
+            return e;
+        }
+    }
+    m->misses++;
+    return NULL;
+}
+
+void memo_store(Interp* in, Memo* m, data* key, unsigned int hash, data* value) {
+    for (MemoEntry* e = m->buckets[hash & (m->n_buckets - 1)]; e != NULL; e = e->chain) {
+        if (e->hash == hash && equal_data(e->key, key)) {
+            e->value = value;
+            return;
+        }
+    }
+    if (m->count >= m->capacity) {
+        MemoEntry* victim = m->oldest;
+        MemoEntry** link = &m->buckets[victim->hash & (m->n_buckets - 1)];
+        while (*link != victim)
+            link = &(*link)->chain;
+        *link = victim->chain;
+        memo_unlink(m, victim);
+        free(victim);
+        m->count--;
+    }
+    if (m->count >= m->n_buckets) {
+        if (!account_bytes(in, m->n_buckets * 2 * sizeof(MemoEntry*)))
+            return;
+        int n = m->n_buckets * 2;
+        MemoEntry** buckets = calloc(n, sizeof(MemoEntry*));
+        for (MemoEntry* e = m->newest; e != NULL; e = e->older) {
+            e->chain = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+        }
+        free(m->buckets);
+        m->buckets = buckets;
+        m->n_buckets = n;
+    }
+    MemoEntry* e = malloc(sizeof(MemoEntry));
+    e->key = key;
+    e->value = value;
+    e->hash = hash;
+    e->chain = m->buckets[hash & (m->n_buckets - 1)];
+    m->buckets[hash & (m->n_buckets - 1)] = e;
+    memo_push_newest(m, e);
+    m->count++;
+}
+
+/* Reached only when a memoized procedure is called from native code; the
+   evaluator does the same without nesting. */
+data* memoized_builtin(Interp* in, int argc, data** argv) {
+    Memo* m = in->callee->value.builtin.info->value.memo;
+    unsigned int hash = memo_hash(argv, argc);
+    MemoEntry* hit = memo_find(m, argv, argc, hash);
+    if (hit != NULL)
+        return hit->value;
+    int at = argv - in->args;
+    push_arg(in, create_list(in, in->args + at, argc, NULL));
+    push_arg(in, in->callee);
+    for (int i = 0; i < argc; i++)
+        push_arg(in, in->args[at + i]);
+    data* value = apply_procedure(in, m->proc, argc);
+    if (in->error == NULL)
+        memo_store(in, m, in->args[at + argc], hash, value);
+    in->args_len = at + argc;
+    return value;
+}
+
+data* memoize_builtin(Interp* in, int argc, data** argv) {
+    data* proc = argv[0];
+    if (proc == NULL || (proc->type != LAMBDA && proc->type != BUILT)) {
+        report_error(in, "memoize: expected procedure\n");
+        return NULL;
+    }
+    int capacity = MEMO_DEFAULT_CAPACITY;
+    if (argc > 1) {
+        if (argv[1] == NULL || argv[1]->type != INTEGER || argv[1]->value.integer < 1) {
+            report_error(in, "memoize: expected a positive capacity\n");
+            return NULL;
+        }
+        capacity = argv[1]->value.integer;
+    }
+    return create_memoized(in, proc, capacity);
+}
+
+/* (memoize-stats f) is the list (hits misses size capacity). */
+data* memoize_stats_builtin(Interp* in, int argc, data** argv) {
+    data* f = argv[0];
+    if (f == NULL || f->type != BUILT || f->value.builtin.fn != memoized_builtin) {
+        report_error(in, "memoize-stats: expected memoized procedure\n");
+        return NULL;
+    }
+    Memo* m = f->value.builtin.info->value.memo;
+    data* items[4] = {
+        create_int(in, (int) m->hits), create_int(in, (int) m->misses),
+        create_int(in, m->count), create_int(in, m->capacity)
+    };
+    return create_list(in, items, 4, NULL);
+}
+
+/* Numeric tower. Exact numbers are integers and rationals, inexact numbers
+   are doubles; an operation with an inexact operand gives an inexact result.
+   The operators work on unboxed Numbers and nested arithmetic is evaluated
+   without boxing intermediate results, so only the final value of a chain
+   like (+ (* a b) (/ c d)) is allocated. Exact results that do not fit in
+   the int fields of data fall back to inexact, since there are no bignums. */
+typedef struct {
+    int exact;
+    long long num;
+    long long den;
+    double flo;
+} Number;
+
+long long gcd_ll(long long a, long long b) {
+    if (a < 0) a = -a;
+    if (b < 0) b = -b;
+    while (b != 0) {
+        long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+double number_to_double(Number* n) {
+    return n->exact ? (double) n->num / n->den : n->flo;
+}
+
+void make_inexact(Number* n) {
+    if (n->exact) {
+        n->flo = number_to_double(n);
+        n->exact = 0;
+    }
+}
+
+/* Reduces an exact result to lowest terms with a positive denominator. */
+void normalize_number(Number* n) {
+    if (!n->exact)
+        return;
+    if (n->den < 0) {
+        n->num = -n->num;
+        n->den = -n->den;
+    }
+    long long g = gcd_ll(n->num, n->den);
+    if (g > 1) {
+        n->num /= g;
+        n->den /= g;
+    }
+}
+
+int to_number(data* d, Number* out) {
+    if (d == NULL)
+        return 0;
+    switch (d->type) {
+        case INTEGER:
+            out->exact = 1;
+            out->num = d->value.integer;
+            out->den = 1;
+            return 1;
+        case RATIONAL:
+            out->exact = 1;
+            out->num = d->value.rational.num;
+            out->den = d->value.rational.den;
+            return 1;
+        case FLOAT:
+            out->exact = 0;
+            out->flo = d->value.floating;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int fits_int(long long v) {
+    return v >= INT_MIN && v <= INT_MAX;
+}
+
+data* box_number(Interp* in, Number* n) {
+    if (n->exact && fits_int(n->num) && fits_int(n->den)) {
+        if (n->den == 1)
+            return create_int(in, (int) n->num);
+        return create_rational(in, (int) n->num, (int) n->den);
+    }
+    return create_float(in, number_to_double(n));
+}
+
+/* a op= b for op one of + - * /. Returns 0 on exact division by zero. */
+int number_op(char op, Number* a, Number* b) {
+    if (a->exact && b->exact) {
+        long long x, y, num, den;
+        int overflow;
+        switch (op) {
+            case '+':
+            case '-':
+                overflow = __builtin_mul_overflow(a->num, b->den, &x) |
+                           __builtin_mul_overflow(b->num, a->den, &y) |
+                           __builtin_mul_overflow(a->den, b->den, &den);
+                if (op == '+')
+                    overflow |= __builtin_add_overflow(x, y, &num);
+                else
+                    overflow |= __builtin_sub_overflow(x, y, &num);
+                break;
+            case '*':
+                overflow = __builtin_mul_overflow(a->num, b->num, &num) |
+                           __builtin_mul_overflow(a->den, b->den, &den);
+                break;
+            default:
+                if (b->num == 0)
+                    return 0;
+                overflow = __builtin_mul_overflow(a->num, b->den, &num) |
+                           __builtin_mul_overflow(a->den, b->num, &den);
+                break;
+        }
+        if (!overflow) {
+            a->num = num;
+            a->den = den;
+            normalize_number(a);
+            return 1;
+        }
+    }
+    double x = number_to_double(a);
+    double y = number_to_double(b);
+    a->exact = 0;
+    switch (op) {
+        case '+': a->flo = x + y; break;
+        case '-': a->flo = x - y; break;
+        case '*': a->flo = x * y; break;
+        default:  a->flo = x / y; break;
+    }
+    return 1;
+}
+
+/* Returns <0, 0 or >0. Exact operands are compared exactly. */
+int compare_numbers(Number* a, Number* b) {
+    if (a->exact && b->exact) {
+        long long x, y;
+        if (!__builtin_mul_overflow(a->num, b->den, &x) &&
+            !__builtin_mul_overflow(b->num, a->den, &y))
+            return (x > y) - (x < y);
+    }
+    double x = number_to_double(a);
+    double y = number_to_double(b);
+    return (x > y) - (x < y);
+}
+
+int is_arithmetic(char* symbol) {
+    return symbol[1] == '\0' &&
+           (symbol[0] == '+' || symbol[0] == '-' || symbol[0] == '*' || symbol[0] == '/');
+}
+
+int is_comparison(char* symbol) {
+    return strcmp(symbol, "<") == 0 || strcmp(symbol, ">") == 0 || strcmp(symbol, "=") == 0 ||
+           strcmp(symbol, "<=") == 0 || strcmp(symbol, ">=") == 0;
+}
+
+#define NOT_SIMPLE 2   /* operand needs a procedure call, see eval */
+
+int eval_arithmetic(Interp* in, char op, data* arg_list, Env* e, Number* out);
+
+/* Start value of a running result: 1 for *, 0 for the others. */
+void arith_init(char op, Number* acc) {
+    acc->exact = 1;
+    acc->num = (op == '*') ? 1 : 0;
+    acc->den = 1;
+}
+
+/* Folds operand number count into acc. Returns 0 on division by zero. */
+int arith_step(Interp* in, char op, Number* acc, int count, Number* n) {
+    if (count == 0 && (op == '-' || op == '/')) {
+        *acc = *n;
+        return 1;
+    }
+    if (!number_op(op, acc, n)) {
+        report_error(in, "division by zero\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* Completes acc after count operands: (- x) is 0 - x and (/ x) is 1 / x. */
+int arith_finish(Interp* in, char op, Number* acc, int count) {
+    if (op != '-' && op != '/')
+        return 1;
+    if (count == 0) {
+        report_error(in, "expected at least 1 argument for '%c'\n", op);
+        return 0;
+    }
+    if (count == 1) {
+        Number r;
+        arith_init(op == '/' ? '*' : '+', &r);
+        if (!number_op(op, &r, acc)) {
+            report_error(in, "division by zero\n");
+            return 0;
+        }
+        *acc = r;
+    }
+    return 1;
+}
+
+int compare_holds(char* op, Number* a, Number* b) {
+    int c = compare_numbers(a, b);
+    if (strcmp(op, "<") == 0)
+        return c < 0;
+    if (strcmp(op, ">") == 0)
+        return c > 0;
+    if (strcmp(op, "<=") == 0)
+        return c <= 0;
+    if (strcmp(op, ">=") == 0)
+        return c >= 0;
+    return c == 0;
+}
+
+/* Applies an operator to already evaluated arguments, as apply and map
+   do when they are given one of + - * / < > = <= >= and or. */
+data* apply_operator(Interp* in, char* op, int argc, data** argv) {
+    if (strcmp(op, "and") == 0 || strcmp(op, "or") == 0) {
+        int result = (strcmp(op, "and") == 0);
+        for (int i = 0; i < argc; i++) {
+            if (op[0] == 'a')
+                result = result && is_truthy(argv[i]);
+            else
+                result = result || is_truthy(argv[i]);
+        }
+        return create_int(in, result);
+    }
+    Number acc, n;
+    if (is_comparison(op) && argc < 2) {
+        report_error(in, "expected at least 2 arguments for relational operator\n");
+        return NULL;
+    }
+    arith_init(op[0], &acc);
+    for (int i = 0; i < argc; i++) {
+        if (!to_number(argv[i], &n)) {
+            report_error(in, "expected number\n");
+            return NULL;
+        }
+        if (is_comparison(op)) {
+            if (i > 0 && !compare_holds(op, &acc, &n))
+                return create_int(in, 0);
+            acc = n;
+        } else if (!arith_step(in, op[0], &acc, i, &n)) {
+            return NULL;
+        }
+    }
+    if (is_comparison(op))
+        return create_int(in, 1);
+    if (!arith_finish(in, op[0], &acc, argc))
+        return NULL;
+    return box_number(in, &acc);
+}
+
+/* Evaluates exp to an unboxed number when that needs no procedure call:
+   numbers, variables and nested arithmetic of those are computed in place
+   instead of going through eval and boxing. Returns 1 on success, 0 on
+   error and NOT_SIMPLE for anything else, which eval then evaluates. */
+int eval_number(Interp* in, data* exp, Env* e, Number* out) {
+    data* v = exp;
+    if (exp != NULL && exp->type == PAIR) {
+        data* op = car(exp);
+        if (op != NULL && op->type == SYMBOL && is_arithmetic(op->value.symbol) &&
+            lookup(e, op->value.symbol) == NULL)
+            return eval_arithmetic(in, op->value.symbol[0], cdr(exp), e, out);
+        return NOT_SIMPLE;
+    }
+    if (exp != NULL && exp->type == SYMBOL)
+        v = lookup_value(in, exp, e, exp->value.symbol);
+    if (!to_number(v, out)) {
+        report_error(in, "expected number\n");
+        return 0;
+    }
+    return 1;
+}
+
+int eval_arithmetic(Interp* in, char op, data* arg_list, Env* e, Number* out) {
+    int count = 0;
+    arith_init(op, out);
+    for (data* it = arg_list; it != NULL && it->type == PAIR; it = cdr(it)) {
+        Number n;
+        int r = eval_number(in, car(it), e, &n);
+        if (r != 1)
+            return r;
+        if (!arith_step(in, op, out, count, &n))
+            return 0;
+        count++;
+    }
+    return arith_finish(in, op, out, count);
+}
+
+/* Chained comparison such as (< a b c). Stops evaluating at the first
+   pair that does not hold. Returns -1 on error. */
+int eval_comparison(Interp* in, char* op, data* arg_list, Env* e) {
+    if (arg_list == NULL || cdr(arg_list) == NULL) {
+        report_error(in, "expected at least 2 arguments for relational operator\n");
+        return -1;
+    }
+    Number prev;
+    int r = eval_number(in, car(arg_list), e, &prev);
+    if (r != 1)
+        return r == 0 ? -1 : r;
+    for (data* it = cdr(arg_list); it != NULL && it->type == PAIR; it = cdr(it)) {
+        Number curr;
+        r = eval_number(in, car(it), e, &curr);
+        if (r != 1)
+            return r == 0 ? -1 : r;
+        if (!compare_holds(op, &prev, &curr))
+            return 0;
+        prev = curr;
+    }
+    return 1;
+}
+
+data* number_arg(Interp* in, data* d, const char* who, Number* out) {
+    if (!to_number(d, out)) {
+        report_error(in, "%s: expected number\n", who);
+        return NULL;
+    }
+    return d;
+}
+
+/* Shared body of the one-argument inexact functions. */
+data* float_function(Interp* in, data* arg, const char* who, double (*fn)(double)) {
+    Number n;
+    if (number_arg(in, arg, who, &n) == NULL)
+        return NULL;
+    return create_float(in, fn(number_to_double(&n)));
+}
+
+data* sqrt_builtin(Interp* in, int argc, data** argv) {
+    Number n;
+    if (number_arg(in, argv[0], "sqrt", &n) == NULL)
+        return NULL;
+    if (n.exact && n.num >= 0) {
+        long long r = (long long) sqrt((double) n.num);
+        long long s = (long long) sqrt((double) n.den);
+        if (r * r == n.num && s * s == n.den) {
+            n.num = r;
+            n.den = s;
+            return box_number(in, &n);
+        }
+    }
+    return create_float(in, sqrt(number_to_double(&n)));
+}
+
+data* exp_builtin(Interp* in, int argc, data** argv) {
+    return float_function(in, argv[0], "exp", exp);
+}
+
+data* log_builtin(Interp* in, int argc, data** argv) {
+    return float_function(in, argv[0], "log", log);
+}
+
+data* sin_builtin(Interp* in, int argc, data** argv) {
+    return float_function(in, argv[0], "sin", sin);
+}
+
+data* cos_builtin(Interp* in, int argc, data** argv) {
+    return float_function(in, argv[0], "cos", cos);
+}
+
+data* atan_builtin(Interp* in, int argc, data** argv) {
+    return float_function(in, argv[0], "atan", atan);
+}
+
+data* expt_builtin(Interp* in, int argc, data** argv) {
+    Number base, power;
+    if (number_arg(in, argv[0], "expt", &base) == NULL || number_arg(in, argv[1], "expt", &power) == NULL)
+        return NULL;
+    if (base.exact && power.exact && power.den == 1) {
+        /* Square and multiply; an overflow turns the result inexact and
+           falls back to pow. */
+        Number result = { 1, 1, 1, 0 };
+        long long n = power.num < 0 ? -power.num : power.num;
+        while (n > 0 && result.exact && base.exact) {
+            if (n & 1)
+                number_op('*', &result, &base);
+            n >>= 1;
+            if (n > 0)
+                number_op('*', &base, &base);
+        }
+        if (result.exact && n == 0) {
+            if (power.num < 0) {
+                Number one = { 1, 1, 1, 0 };
+                if (!number_op('/', &one, &result)) {
+                    report_error(in, "division by zero\n");
+                    return NULL;
+                }
+                result = one;
+            }
+            return box_number(in, &result);
+        }
+        to_number(argv[0], &base);
+    }
+    return create_float(in, pow(number_to_double(&base), number_to_double(&power)));
+}
+
+/* floor, ceiling, round and truncate keep the exactness of their argument. */
+data* rounding(Interp* in, data* arg, const char* who, double (*fn)(double)) {
+    Number n;
+    if (number_arg(in, arg, who, &n) == NULL)
+        return NULL;
+    if (!n.exact)
+        return create_float(in, fn(n.flo));
+    if (n.den != 1) {
+        n.num = (long long) fn((double) n.num / n.den);
+        n.den = 1;
+    }
+    return box_number(in, &n);
+}
+
+data* floor_builtin(Interp* in, int argc, data** argv) {
+    return rounding(in, argv[0], "floor", floor);
+}
+
+data* ceiling_builtin(Interp* in, int argc, data** argv) {
+    return rounding(in, argv[0], "ceiling", ceil);
+}
+
+data* round_builtin(Interp* in, int argc, data** argv) {
+    return rounding(in, argv[0], "round", nearbyint);
+}
+
+data* truncate_builtin(Interp* in, int argc, data** argv) {
+    return rounding(in, argv[0], "truncate", trunc);
+}
+
+data* abs_builtin(Interp* in, int argc, data** argv) {
+    Number n;
+    if (number_arg(in, argv[0], "abs", &n) == NULL)
+        return NULL;
+    if (n.exact)
+        n.num = n.num < 0 ? -n.num : n.num;
+    else
+        n.flo = fabs(n.flo);
+    return box_number(in, &n);
+}
+
+/* min and max; the result is inexact if any argument is. */
+data* min_max(Interp* in, int argc, data** argv, const char* who, int sign) {
+    Number best;
+    if (number_arg(in, argv[0], who, &best) == NULL)
+        return NULL;
+    int exact = best.exact;
+    for (int i = 1; i < argc; i++) {
+        Number n;
+        if (number_arg(in, argv[i], who, &n) == NULL)
+            return NULL;
+        exact = exact && n.exact;
+        if (compare_numbers(&n, &best) * sign > 0)
+            best = n;
+    }
+    if (!exact)
+        make_inexact(&best);
+    return box_number(in, &best);
+}
+
+data* min_builtin(Interp* in, int argc, data** argv) {
+    return min_max(in, argc, argv, "min", -1);
+}
+
+data* max_builtin(Interp* in, int argc, data** argv) {
+    return min_max(in, argc, argv, "max", 1);
+}
+
+/* quotient, remainder and modulo on integers. */
+data* integer_division(Interp* in, data** argv, const char* who, char op) {
+    Number a = { 0 }, b = { 0 };
+    if (number_arg(in, argv[0], who, &a) == NULL || number_arg(in, argv[1], who, &b) == NULL)
+        return NULL;
+    if (!a.exact || !b.exact || a.den != 1 || b.den != 1) {
+        report_error(in, "%s: expected integers\n", who);
+        return NULL;
+    }
+    if (b.num == 0) {
+        report_error(in, "division by zero\n");
+        return NULL;
+    }
+    Number r = { 1, 0, 1, 0 };
+    if (op == 'q') {
+        r.num = a.num / b.num;
+    } else {
+        r.num = a.num % b.num;
+        if (op == 'm' && r.num != 0 && (r.num < 0) != (b.num < 0))
+            r.num += b.num;
+    }
+    return box_number(in, &r);
+}
+
+data* quotient_builtin(Interp* in, int argc, data** argv) {
+    return integer_division(in, argv, "quotient", 'q');
+}
+
+data* remainder_builtin(Interp* in, int argc, data** argv) {
+    return integer_division(in, argv, "remainder", 'r');
+}
+
+data* modulo_builtin(Interp* in, int argc, data** argv) {
+    return integer_division(in, argv, "modulo", 'm');
+}
+
+data* exact_to_inexact_builtin(Interp* in, int argc, data** argv) {
+    Number n;
+    if (number_arg(in, argv[0], "exact->inexact", &n) == NULL)
+        return NULL;
+    return create_float(in, number_to_double(&n));
+}
+
+/* Converts a double to the exact rational it represents, as long as
+   numerator and denominator fit. */
+data* inexact_to_exact_builtin(Interp* in, int argc, data** argv) {
+    Number n;
+    if (number_arg(in, argv[0], "inexact->exact", &n) == NULL)
+        return NULL;
+    if (n.exact)
+        return argv[0];
+    double v = n.flo;
+    long long den = 1;
+    while (v != floor(v) && den < (1LL << 30)) {
+        v *= 2;
+        den *= 2;
+    }
+    if (v != floor(v) || !fits_int((long long) v)) {
+        report_error(in, "inexact->exact: no exact representation\n");
+        return NULL;
+    }
+    n.exact = 1;
+    n.num = (long long) v;
+    n.den = den;
+    normalize_number(&n);
+    return box_number(in, &n);
+}
+
+data* number_p_builtin(Interp* in, int argc, data** argv) {
+    Number n;
+    return create_int(in, to_number(argv[0], &n));
+}
+
+data* exact_p_builtin(Interp* in, int argc, data** argv) {
+    Number n;
+    if (number_arg(in, argv[0], "exact?", &n) == NULL)
+        return NULL;
+    return create_int(in, n.exact);
+}
+
+data* inexact_p_builtin(Interp* in, int argc, data** argv) {
+    Number n;
+    if (number_arg(in, argv[0], "inexact?", &n) == NULL)
+        return NULL;
+    return create_int(in, !n.exact);
+}
+
+/* Baseline JIT. Global procedures that get called often are compiled to
+   x86-64 machine code when their body only uses integer literals, their
+   own parameters, if, the arithmetic and comparison operators and calls
+   to other such global procedures. Compiled code works on 32-bit integers
+   and falls back to the interpreter ("bails") whenever that is not enough:
+   on entry the arguments must all be INTEGERs, arithmetic overflow, a
+   callee that has been redefined and a too deep native stack all bail.
+   Since compiled code cannot have side effects, a bailed call is simply
+   evaluated again by the interpreter. */
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#define JIT_THRESHOLD 50         /* calls before a procedure is compiled */
+#define JIT_MAX_BAILS 20         /* bails before the compiled code is given up */
+#define JIT_MAX_PARAMS 6         /* arguments are passed in registers */
+#define JIT_STACK_BYTES (1024 * 1024)
+
+enum { JIT_NONE, JIT_COMPILING, JIT_COMPILED, JIT_FAILED };
+
+struct JitCode {
+    int state;
+    int calls;
+    int bails;
+    int nparams;
+    void* code;
+    size_t size;
+    data** deps;      /* procedures called by the code, kept alive by it */
+    int n_deps;
+};
+
+typedef long (*jit_fn)(long, long, long, long, long, long);
+
+JitCode* get_jit_code(data* lambda) {
+    if (lambda->value.lambda.jit == NULL) {
+        JitCode* j = malloc(sizeof(JitCode));
+        j->state = JIT_NONE;
+        j->calls = 0;
+        j->bails = 0;
+        j->nparams = 0;
+        j->code = NULL;
+        j->size = 0;
+        j->deps = NULL;
+        j->n_deps = 0;
+        lambda->value.lambda.jit = j;
+    }
+    return lambda->value.lambda.jit;
+}
+
+void free_jit_code(JitCode* j) {
+    if (j == NULL) return;
+#if JIT_SUPPORTED
+    if (j->code != NULL)
+        munmap(j->code, j->size);
+#endif
+    free(j->deps);
+    free(j);
+}
+
+void mark_data(Interp* in, data* d);
+
+void mark_jit_code(Interp* in, JitCode* j) {
+    if (j == NULL) return;
+    for (int i = 0; i < j->n_deps; i++)
+        mark_data(in, j->deps[i]);
+}
+
+Node* lookup_node(Env* e, char* name) {
+    for (Node* curr = e->begin; curr != NULL; curr = curr->next) {
+        if (strcmp(curr->name, name) == 0)
+            return curr;
+    }
+    return NULL;
+}
+
+#if JIT_SUPPORTED
+
+typedef struct {
+    Interp* in;
+    JitCode* j;
+    data* self;
+    data* params;
+    unsigned char* buf;
+    int len;
+    int cap;
+    int* bail_fixups;       /* rel32 operands jumping to the bail exit */
+    int n_bail;
+    int* ret_fixups;        /* rel32 operands jumping to the plain exit */
+    int n_ret;
+    int body_start;
+    int ok;
+} JitCompiler;
+
+void emit_byte(JitCompiler* c, unsigned char b) {
+    if (c->len >= c->cap) {
+        c->cap *= 2;
+        c->buf = realloc(c->buf, c->cap);
+    }
+    c->buf[c->len++] = b;
+}
+
+void emit_bytes(JitCompiler* c, const char* bytes, int n) {
+    for (int i = 0; i < n; i++)
+        emit_byte(c, (unsigned char) bytes[i]);
+}
+
+void emit_u32(JitCompiler* c, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        emit_byte(c, (v >> (8 * i)) & 0xff);
+}
+
+void emit_u64(JitCompiler* c, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        emit_byte(c, (v >> (8 * i)) & 0xff);
+}
+
+void patch_rel32(JitCompiler* c, int at, int target) {
+    uint32_t rel = (uint32_t) (target - (at + 4));
+    for (int i = 0; i < 4; i++)
+        c->buf[at + i] = (rel >> (8 * i)) & 0xff;
+}
+
+int add_fixup(int** fixups, int* n, int at) {
+    *fixups = realloc(*fixups, (*n + 1) * sizeof(int));
+    (*fixups)[(*n)++] = at;
+    return at;
+}
+
+/* Jump with a 0F 8x rel32 condition code (0x80 = jo, 0x84 = je, ...). */
+void emit_jcc_bail(JitCompiler* c, unsigned char cc) {
+    emit_byte(c, 0x0f);
+    emit_byte(c, cc);
+    add_fixup(&c->bail_fixups, &c->n_bail, c->len);
+    emit_u32(c, 0);
+}
+
+void emit_jcc_ret(JitCompiler* c, unsigned char cc) {
+    emit_byte(c, 0x0f);
+    emit_byte(c, cc);
+    add_fixup(&c->ret_fixups, &c->n_ret, c->len);
+    emit_u32(c, 0);
+}
+
+int param_index(JitCompiler* c, char* name) {
+    int i = 0;
+    for (data* p = c->params; p != NULL && p->type == PAIR; p = cdr(p), i++) {
+        if (strcmp(car(p)->value.symbol, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int slot_disp(int i) {
+    return -8 * (i + 1);
+}
+
+int list_length(data* l) {
+    int n = 0;
+    for (; l != NULL && l->type == PAIR; l = cdr(l))
+        n++;
+    return n;
+}
+
+int jit_compile(Interp* in, data* lambda);
+void jit_expr(JitCompiler* c, data* exp, int tail);
+
+/* Compiles (op a b ...) for + - *: result in eax. */
+void jit_arith(JitCompiler* c, char op, data* args) {
+    int n = list_length(args);
+    if (n == 0) {
+        emit_byte(c, 0xb8);                            /* mov eax, imm32 */
+        emit_u32(c, op == '*' ? 1 : 0);
+        return;
+    }
+    jit_expr(c, car(args), 0);
+    if (n == 1) {
+        if (op == '-') {
+            emit_bytes(c, "\xf7\xd8", 2);              /* neg eax */
+            emit_jcc_bail(c, 0x80);                    /* jo bail */
+        }
+        return;
+    }
+    for (data* it = cdr(args); it != NULL && it->type == PAIR; it = cdr(it)) {
+        emit_byte(c, 0x50);                            /* push rax */
+        jit_expr(c, car(it), 0);
+        emit_bytes(c, "\x89\xc1", 2);                  /* mov ecx, eax */
+        emit_byte(c, 0x58);                            /* pop rax */
+        if (op == '+')
+            emit_bytes(c, "\x01\xc8", 2);              /* add eax, ecx */
+        else if (op == '-')
+            emit_bytes(c, "\x29\xc8", 2);              /* sub eax, ecx */
+        else
+            emit_bytes(c, "\x0f\xaf\xc1", 3);          /* imul eax, ecx */
+        emit_jcc_bail(c, 0x80);                        /* jo bail */
+    }
+}
+
+/* Compiles a chained comparison: result 0 or 1 in eax. */
+void jit_compare(JitCompiler* c, char* op, data* args) {
+    if (list_length(args) != 2) {
+        c->ok = 0;
+        return;
+    }
+    unsigned char setcc;
+    if (strcmp(op, "<") == 0)
+        setcc = 0x9c;
+    else if (strcmp(op, ">") == 0)
+        setcc = 0x9f;
+    else if (strcmp(op, "<=") == 0)
+        setcc = 0x9e;
+    else if (strcmp(op, ">=") == 0)
+        setcc = 0x9d;
+    else
+        setcc = 0x94;
+    jit_expr(c, car(args), 0);
+    emit_byte(c, 0x50);                                /* push rax */
+    jit_expr(c, car(cdr(args)), 0);
+    emit_bytes(c, "\x89\xc1", 2);                      /* mov ecx, eax */
+    emit_byte(c, 0x58);                                /* pop rax */
+    emit_bytes(c, "\x39\xc8", 2);                      /* cmp eax, ecx */
+    emit_byte(c, 0x0f);
+    emit_byte(c, setcc);                               /* setcc al */
+    emit_byte(c, 0xc0);
+    emit_bytes(c, "\x0f\xb6\xc0", 3);                  /* movzx eax, al */
+}
+
+/* Compiles a call to a global procedure. The binding is checked at run
+   time, so a redefinition makes the call bail instead of reaching stale
+   code. Self calls in tail position become a jump back to the body. */
+void jit_call_global(JitCompiler* c, char* name, data* args, int tail) {
+    Interp* in = c->in;
+    Node* node = lookup_node(in->glob_env, name);
+    data* callee = node != NULL ? (data*) node->value : NULL;
+    int argc = list_length(args);
+    if (callee == NULL || callee->type != LAMBDA || callee->value.lambda.e != in->glob_env ||
+        list_length(callee->value.lambda.parameter) != argc || argc > JIT_MAX_PARAMS) {
+        c->ok = 0;
+        return;
+    }
+    JitCode* target = get_jit_code(callee);
+    if (target->state == JIT_NONE)
+        jit_compile(in, callee);
+    if (target->state == JIT_FAILED) {
+        c->ok = 0;
+        return;
+    }
+    if (callee != c->self) {
+        c->j->deps = realloc(c->j->deps, (c->j->n_deps + 1) * sizeof(data*));
+        c->j->deps[c->j->n_deps++] = callee;
+    }
+
+    for (data* it = args; it != NULL && it->type == PAIR; it = cdr(it)) {
+        jit_expr(c, car(it), 0);
+        emit_byte(c, 0x50);                            /* push rax */
+    }
+    emit_bytes(c, "\x48\xb8", 2);                      /* mov rax, &node->value */
+    emit_u64(c, (uint64_t) (uintptr_t) &node->value);
+    emit_bytes(c, "\x48\x8b\x00", 3);                  /* mov rax, [rax] */
+    emit_bytes(c, "\x48\xba", 2);                      /* mov rdx, callee */
+    emit_u64(c, (uint64_t) (uintptr_t) callee);
+    emit_bytes(c, "\x48\x39\xd0", 3);                  /* cmp rax, rdx */
+    emit_jcc_bail(c, 0x85);                            /* jne bail */
+
+    if (tail && callee == c->self) {
+        for (int i = argc - 1; i >= 0; i--) {
+            emit_byte(c, 0x58);                        /* pop rax */
+            emit_bytes(c, "\x48\x89\x85", 3);          /* mov [rbp+disp32], rax */
+            emit_u32(c, (uint32_t) slot_disp(i));
+        }
+        emit_byte(c, 0xe9);                            /* jmp body */
+        emit_u32(c, 0);
+        patch_rel32(c, c->len - 4, c->body_start);
+        return;
+    }
+
+    static const char* pops[JIT_MAX_PARAMS] = {
+        "\x5f", "\x5e", "\x5a", "\x59", "\x41\x58", "\x41\x59"   /* rdi rsi rdx rcx r8 r9 */
+    };
+    for (int i = argc - 1; i >= 0; i--)
+        emit_bytes(c, pops[i], i < 4 ? 1 : 2);
+    emit_bytes(c, "\x48\xb8", 2);                      /* mov rax, &target->code */
+    emit_u64(c, (uint64_t) (uintptr_t) &target->code);
+    emit_bytes(c, "\x48\x8b\x00", 3);                  /* mov rax, [rax] */
+    emit_bytes(c, "\x48\x85\xc0", 3);                  /* test rax, rax */
+    emit_jcc_bail(c, 0x84);                            /* jz bail */
+    emit_bytes(c, "\xff\xd0", 2);                      /* call rax */
+    emit_bytes(c, "\x48\xba", 2);                      /* mov rdx, &in->jit_bail */
+    emit_u64(c, (uint64_t) (uintptr_t) &in->jit_bail);
+    emit_bytes(c, "\x83\x3a\x00", 3);                  /* cmp dword [rdx], 0 */
+    emit_jcc_ret(c, 0x85);                             /* jne exit */
+}
+
+void jit_expr(JitCompiler* c, data* exp, int tail) {
+    if (!c->ok)
+        return;
+    if (exp == NULL) {
+        c->ok = 0;
+        return;
+    }
+    if (exp->type == INTEGER) {
+        emit_byte(c, 0xb8);                            /* mov eax, imm32 */
+        emit_u32(c, (uint32_t) exp->value.integer);
+        return;
+    }
+    if (exp->type == SYMBOL) {
+        int i = param_index(c, exp->value.symbol);
+        if (i < 0) {
+            c->ok = 0;
+            return;
+        }
+        emit_bytes(c, "\x8b\x85", 2);                  /* mov eax, [rbp+disp32] */
+        emit_u32(c, (uint32_t) slot_disp(i));
+        return;
+    }
+    if (exp->type != PAIR || car(exp) == NULL || car(exp)->type != SYMBOL) {
+        c->ok = 0;
+        return;
+    }
+    char* head = car(exp)->value.symbol;
+    data* args = cdr(exp);
+    if (param_index(c, head) >= 0) {
+        c->ok = 0;
+        return;
+    }
+    if (strcmp(head, "#%guard") == 0) {
+        for (data* it = car(args); it != NULL && it->type == PAIR; it = cdr(it)) {
+            data* dep = car(it);
+            Node* node = lookup_node(c->in->glob_env, car(dep)->value.symbol);
+            if (node == NULL) {
+                c->ok = 0;
+                return;
+            }
+            emit_bytes(c, "\x48\xb8", 2);              /* mov rax, &node->value */
+            emit_u64(c, (uint64_t) (uintptr_t) &node->value);
+            emit_bytes(c, "\x48\x8b\x00", 3);          /* mov rax, [rax] */
+            emit_bytes(c, "\x48\xba", 2);              /* mov rdx, value */
+            emit_u64(c, (uint64_t) (uintptr_t) cdr(dep));
+            emit_bytes(c, "\x48\x39\xd0", 3);          /* cmp rax, rdx */
+            emit_jcc_bail(c, 0x85);                    /* jne bail */
+        }
+        jit_expr(c, car(cdr(args)), tail);
+        return;
+    }
+    if (strcmp(head, "if") == 0) {
+        if (list_length(args) != 3) {
+            c->ok = 0;
+            return;
+        }
+        jit_expr(c, car(args), 0);
+        emit_bytes(c, "\x85\xc0", 2);                  /* test eax, eax */
+        emit_bytes(c, "\x0f\x84", 2);                  /* je else */
+        int to_else = c->len;
+        emit_u32(c, 0);
+        jit_expr(c, car(cdr(args)), tail);
+        emit_byte(c, 0xe9);                            /* jmp end */
+        int to_end = c->len;
+        emit_u32(c, 0);
+        patch_rel32(c, to_else, c->len);
+        jit_expr(c, car(cdr(cdr(args))), tail);
+        patch_rel32(c, to_end, c->len);
+        return;
+    }
+    if (is_operator(head) && lookup(c->in->glob_env, head) == NULL) {
+        if (is_arithmetic(head) && head[0] != '/')
+            jit_arith(c, head[0], args);
+        else if (is_comparison(head))
+            jit_compare(c, head, args);
+        else
+            c->ok = 0;
+        return;
+    }
+    jit_call_global(c, head, args, tail);
+}
+
+/* Compiles lambda if its body is in the supported subset. Sets the
+   JitCode state to JIT_COMPILED or JIT_FAILED. */
+int jit_compile(Interp* in, data* lambda) {
+    JitCode* j = get_jit_code(lambda);
+    data* params = lambda->value.lambda.parameter;
+    int nparams = list_length(params);
+    j->state = JIT_FAILED;
+    if (nparams > JIT_MAX_PARAMS)
+        return 0;
+    for (data* p = params; p != NULL && p->type == PAIR; p = cdr(p)) {
+        if (car(p) == NULL || car(p)->type != SYMBOL)
+            return 0;
+    }
+    j->state = JIT_COMPILING;
+    j->nparams = nparams;
+
+    JitCompiler c;
+    c.in = in;
+    c.j = j;
+    c.self = lambda;
+    c.params = params;
+    c.cap = 256;
+    c.len = 0;
+    c.buf = malloc(c.cap);
+    c.bail_fixups = NULL;
+    c.n_bail = 0;
+    c.ret_fixups = NULL;
+    c.n_ret = 0;
+    c.ok = 1;
+
+    static const char* stores[JIT_MAX_PARAMS] = {
+        "\x48\x89\xbd", "\x48\x89\xb5", "\x48\x89\x95",     /* mov [rbp+disp32], rdi/rsi/rdx */
+        "\x48\x89\x8d", "\x4c\x89\x85", "\x4c\x89\x8d"      /* rcx, r8, r9 */
+    };
+    emit_byte(&c, 0x55);                               /* push rbp */
+    emit_bytes(&c, "\x48\x89\xe5", 3);                 /* mov rbp, rsp */
+    emit_bytes(&c, "\x48\x81\xec", 3);                 /* sub rsp, imm32 */
+    emit_u32(&c, (uint32_t) (8 * ((nparams + 1) & ~1)));
+    for (int i = 0; i < nparams; i++) {
+        emit_bytes(&c, stores[i], 3);
+        emit_u32(&c, (uint32_t) slot_disp(i));
+    }
+    c.body_start = c.len;
+    emit_bytes(&c, "\x48\xb8", 2);                     /* mov rax, &in->jit_stack_limit */
+    emit_u64(&c, (uint64_t) (uintptr_t) &in->jit_stack_limit);
+    emit_bytes(&c, "\x48\x3b\x20", 3);                 /* cmp rsp, [rax] */
+    emit_jcc_bail(&c, 0x82);                           /* jb bail */
+    emit_bytes(&c, "\x48\xb8", 2);                     /* mov rax, &in->fuel */
+    emit_u64(&c, (uint64_t) (uintptr_t) &in->fuel);
+    emit_bytes(&c, "\x48\x83\x28\x01", 4);             /* sub qword [rax], 1 */
+    emit_jcc_bail(&c, 0x8c);                           /* jl bail */
+
+    jit_expr(&c, lambda->value.lambda.body, 1);
+
+    emit_byte(&c, 0xc9);                               /* leave */
+    emit_byte(&c, 0xc3);                               /* ret */
+    int bail = c.len;
+    emit_bytes(&c, "\x48\xb8", 2);                     /* mov rax, &in->jit_bail */
+    emit_u64(&c, (uint64_t) (uintptr_t) &in->jit_bail);
+    emit_bytes(&c, "\xc7\x00\x01\x00\x00\x00", 6);     /* mov dword [rax], 1 */
+    int exit = c.len;
+    emit_byte(&c, 0xc9);                               /* leave */
+    emit_byte(&c, 0xc3);                               /* ret */
+    for (int i = 0; i < c.n_bail; i++)
+        patch_rel32(&c, c.bail_fixups[i], bail);
+    for (int i = 0; i < c.n_ret; i++)
+        patch_rel32(&c, c.ret_fixups[i], exit);
+
+    if (c.ok) {
+        void* mem = mmap(NULL, c.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            memcpy(mem, c.buf, c.len);
+            if (mprotect(mem, c.len, PROT_READ | PROT_EXEC) == 0) {
+                j->code = mem;
+                j->size = c.len;
+            } else {
+                munmap(mem, c.len);
+            }
+        }
+    }
+    free(c.buf);
+    free(c.bail_fixups);
+    free(c.ret_fixups);
+    if (j->code == NULL) {
+        free(j->deps);
+        j->deps = NULL;
+        j->n_deps = 0;
+    }
+    j->state = j->code != NULL ? JIT_COMPILED : JIT_FAILED;
+    return j->code != NULL;
+}
+
+#endif
+
+/* Called by eval for every application of a global procedure, with the
+   evaluated arguments on top of the argument buffer. Counts the call,
+   compiles the procedure once it is hot and runs the compiled code when
+   the arguments allow it. Returns 0 if the interpreter has to do the call. */
+int jit_call(Interp* in, data* f, int argc, data** result) {
+#if JIT_SUPPORTED
+    if (!in->jit_enabled || f->value.lambda.e != in->glob_env)
+        return 0;
+    JitCode* j = get_jit_code(f);
+    if (j->state == JIT_FAILED)
+        return 0;
+    if (j->code == NULL) {
+        if (++j->calls < JIT_THRESHOLD || !jit_compile(in, f))
+            return 0;
+    }
+    if (argc != j->nparams)
+        return 0;
+    long a[JIT_MAX_PARAMS] = { 0 };
+    data** argv = in->args + in->args_len - argc;
+    for (int i = 0; i < argc; i++) {
+        if (argv[i] == NULL || argv[i]->type != INTEGER)
+            return 0;
+        a[i] = argv[i]->value.integer;
+    }
+    char marker;
+    in->jit_stack_limit = (uintptr_t) &marker - JIT_STACK_BYTES;
+    in->jit_bail = 0;
+    int r = (int) ((jit_fn) j->code)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    if (in->jit_bail) {
+        in->jit_bail = 0;
+        if (in->fuel >= 0 && ++j->bails >= JIT_MAX_BAILS)
+            j->state = JIT_FAILED;
+        return 0;
+    }
+    *result = create_int(in, r);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Evaluator. eval keeps its continuation in in->frames, a growable array
+   on the heap, instead of recursing on the C stack: evaluating a subform
+   whose value is still needed pushes a frame saying what to do with that
+   value, and calls in tail position push nothing. Recursion depth is then
+   bounded by in->stack_limit, and running out of it aborts the evaluation
+   with an error instead of crashing the process. */
+#define DEFAULT_STACK_LIMIT (64 * 1024 * 1024)
+#define MAX_NESTED_EVALS 1000
+
+typedef enum {
+    K_IF,       /* exp is the if form */
+    K_DEFINE,   /* exp is the variable */
+    K_HEAD,     /* exp is an application whose procedure is being computed */
+    K_ARGS,     /* exp holds the arguments still to evaluate for f */
+    K_ARITH,    /* exp holds the operands still to evaluate for operator f */
+    K_COMPARE,
+    K_LOGIC,
+    K_MAP,      /* exp holds the elements still to pass to f */
+    K_STREAM,   /* exp is the cons-stream form */
+    K_FORCE,    /* exp is the promise being forced */
+    K_MEMO      /* exp is the argument list of a call of memoized f */
+} FrameKind;
+
+struct Frame {
+    FrameKind kind;
+    int count;      /* arguments or operands done so far */
+    int base;       /* argument buffer position the results start at */
+    data* exp;
+    data* f;
+    Env* env;
+    Number acc;     /* running result of K_ARITH and K_COMPARE */
+};
+
+/* Aborts the current top-level evaluation: every run of the evaluator
+   unwinds its frames and returns NULL. The message stays available through
+   last_error() until the next top-level form. */
+void scheme_error(Interp* in, const char* msg) {
+    report_error(in, "%s\n", msg);
+    in->error = msg;
+}
+
+Frame* push_frame(Interp* in, FrameKind kind, data* exp, Env* env) {
+    if (in->frames_len >= in->frames_cap) {
+        size_t max = in->stack_limit / sizeof(Frame);
+        if ((size_t) in->frames_len >= max) {
+            scheme_error(in, "stack limit exceeded");
+            return NULL;
+        }
+        size_t cap = (size_t) in->frames_cap * 2;
+        in->frames_cap = (int) (cap < max ? cap : max);
+        in->frames = realloc(in->frames, in->frames_cap * sizeof(Frame));
+    }
+    Frame* k = &in->frames[in->frames_len++];
+    k->kind = kind;
+    k->count = 0;
+    k->base = in->args_len;
+    k->exp = exp;
+    k->f = NULL;
+    k->env = env;
+    return k;
+}
+
+/* Adds the value n of the current operand to a K_ARITH or K_COMPARE frame.
+   Returns 0 when that settles the result: the frame is then popped and
+   *val holds the value (NULL on error, 0 for a comparison that fails). */
+int fold_operand(Interp* in, Frame* k, Number* n, data** val) {
+    k->exp = cdr(k->exp);
+    if (k->kind == K_ARITH) {
+        if (!arith_step(in, k->f->value.symbol[0], &k->acc, k->count++, n)) {
+            in->frames_len--;
+            *val = NULL;
+            return 0;
+        }
+        return 1;
+    }
+    if (k->count++ > 0 && !compare_holds(k->f->value.symbol, &k->acc, n)) {
+        in->frames_len--;
+        *val = create_int(in, 0);
+        return 0;
+    }
+    k->acc = *n;
+    return 1;
+}
+
+/* Runs the evaluator until the frames it pushes are used up. With f set it
+   starts by applying f to the top argc values of the argument buffer,
+   otherwise by evaluating x in e. */
+data* run_machine(Interp* in, data* x, Env* e, data* f, int argc) {
+    int frames_base = in->frames_len;
+    int args_base = in->args_len - argc;
+    data* val = NULL;
+    Frame* k;
+    if (++in->eval_depth > MAX_NESTED_EVALS)
+        scheme_error(in, "too many nested evaluations");
+    if (in->error != NULL)
+        goto done;
+    if (f != NULL)
+        goto apply;
+
+eval:
+    if (x == NULL) {
+        val = NULL;
+        goto ret;
+    }
+    if (x->type == SYMBOL) {
+        val = lookup_value(in, x, e, x->value.symbol);
+        if (val == NULL && is_operator(x->value.symbol))
+            val = x;
+        goto ret;
+    }
+    if (x->type != PAIR) {
+        val = x;
+        goto ret;
+    }
+    data* first = car(x);
+    if (first == NULL || first->type != SYMBOL) {
+        k = push_frame(in, K_HEAD, x, e);
+        if (k == NULL)
+            goto ret;
+        x = first;
+        goto eval;
+    }
+    char* name = first->value.symbol;
+    if (strcmp(name, "quote") == 0) {
+        val = car(cdr(x));
+        goto ret;
+    } else if (strcmp(name, "lambda") == 0) {
+        val = create_lambda(in, car(cdr(x)), car(cdr(cdr(x))), e);
+        goto ret;
+    } else if (strcmp(name, "define") == 0) {
+        data* var = car(cdr(x));
+        if (var != NULL && var->type == SYMBOL) {
+            if (push_frame(in, K_DEFINE, var, e) == NULL)
+                goto ret;
+            x = car(cdr(cdr(x)));
+            goto eval;
+        }
+        val = NULL;
+        if (var != NULL && var->type == PAIR) {
+            data* f_name = car(var);
+            val = create_lambda(in, cdr(var), car(cdr(cdr(x))), e);
+            if (e == in->glob_env && is_operator(f_name->value.symbol))
+                in->jit_enabled = 0;   /* compiled code inlines the operators */
+            define_variable(in, e, f_name->value.symbol, val);
+        }
+        goto ret;
+    } else if (strcmp(name, "if") == 0) {
+        if (push_frame(in, K_IF, x, e) == NULL)
+            goto ret;
+        x = car(cdr(x));
+        goto eval;
+    } else if (strcmp(name, "#%guard") == 0) {
+        /* (#%guard ((name . value) ...) fast slow), made by the optimizer */
+        data* branch = car(cdr(cdr(x)));
+        for (data* it = car(cdr(x)); it != NULL && it->type == PAIR; it = cdr(it)) {
+            data* dep = car(it);
+            if (lookup(e, car(dep)->value.symbol) != cdr(dep)) {
+                branch = car(cdr(cdr(cdr(x))));
+                break;
+            }
+        }
+        x = branch;
+        goto eval;
+    } else if (strcmp(name, "delay") == 0 || strcmp(name, "delay-force") == 0) {
+        val = create_promise(in, car(cdr(x)), e, name[5] == '-');
+        goto ret;
+    } else if (strcmp(name, "cons-stream") == 0) {
+        if (push_frame(in, K_STREAM, x, e) == NULL)
+            goto ret;
+        x = car(cdr(x));
+        goto eval;
+    } else if (strcmp(name, "define-memoized") == 0) {
+        /* (define-memoized (name . params) body) */
+        data* var = car(cdr(x));
+        val = NULL;
+        if (var != NULL && var->type == PAIR && car(var) != NULL && car(var)->type == SYMBOL) {
+            data* proc = create_lambda(in, cdr(var), car(cdr(cdr(x))), e);
+            data* memo = create_memoized(in, proc, MEMO_DEFAULT_CAPACITY);
+            if (memo == NULL)
+                goto ret;
+            define_variable(in, e, car(var)->value.symbol, memo);
+            val = create_symbol(in, "#<unspecified>");
+        }
+        goto ret;
+    } else if (strcmp(name, "define-record-type") == 0) {
+        val = define_record_type(in, x, e);
+        goto ret;
+    }
+
+    f = lookup_value(in, x, e, name);
+    if ((f == NULL || (f->type != LAMBDA && f->type != BUILT)) && is_operator(name)) {
+        data* arg_list = cdr(x);
+        if (is_arithmetic(name)) {
+            Number n;
+            push_arg(in, x);    /* no frame holds x while a lazy operand loads */
+            int r = eval_arithmetic(in, name[0], arg_list, e, &n);
+            in->args_len--;
+            if (r != NOT_SIMPLE) {
+                val = r ? box_number(in, &n) : NULL;
+                goto ret;
+            }
+            k = push_frame(in, K_ARITH, arg_list, e);
+            if (k == NULL)
+                goto ret;
+            k->f = first;
+            arith_init(name[0], &k->acc);
+            goto operand;
+        } else if (is_comparison(name)) {
+            push_arg(in, x);
+            int holds = eval_comparison(in, name, arg_list, e);
+            in->args_len--;
+            if (holds != NOT_SIMPLE) {
+                val = holds < 0 ? NULL : create_int(in, holds);
+                goto ret;
+            }
+            k = push_frame(in, K_COMPARE, arg_list, e);
+        } else {
+            if (arg_list == NULL || arg_list->type != PAIR) {
+                report_error(in, "expected at least 1 argument for logical operator\n");
+                val = NULL;
+                goto ret;
+            }
+            k = push_frame(in, K_LOGIC, arg_list, e);
+            if (k != NULL)
+                k->count = (strcmp(name, "and") == 0);
+        }
+        if (k == NULL)
+            goto ret;
+        k->f = first;
+        goto operand;
+    }
+
+call:
+    /* f is the procedure value of the application x */
+    if (f == NULL || (f->type != LAMBDA && f->type != BUILT)) {
+        val = NULL;
+        goto ret;
+    }
+    k = push_frame(in, K_ARGS, cdr(x), e);
+    if (k == NULL)
+        goto ret;
+    k->f = f;
+
+argument:
+    k = &in->frames[in->frames_len - 1];
+    if (k->exp != NULL && k->exp->type == PAIR) {
+        x = car(k->exp);
+        e = k->env;
+        goto eval;
+    }
+    f = k->f;
+    argc = k->count;
+    in->frames_len--;
+
+apply:
+    /* f is applied to the top argc values of the argument buffer */
+    if (f != NULL && f->type == LAMBDA) {
+        int base = in->args_len - argc;
+        if (jit_call(in, f, argc, &val)) {
+            in->args_len = base;
+            goto ret;
+        }
+        /* compiled code takes its own fuel */
+        if (--in->fuel < 0 || in->bytes_allocated > in->alloc_stop) {
+            scheme_error(in, in->fuel < 0 ? "fuel exhausted" : "allocation limit exceeded");
+            val = NULL;
+            goto ret;
+        }
+        Env* new_e = create_environment(in, f->value.lambda.e);
+        data* params = f->value.lambda.parameter;
+        for (int i = 0; i < argc && params && params->type == PAIR; i++) {
+            add_elements_to_environment(in, new_e, car(params)->value.symbol, in->args[base + i]);
+            params = cdr(params);
+        }
+        in->args_len = base;
+        x = f->value.lambda.body;
+        e = new_e;
+        /* a safe point: everything live is in the frames, the argument
+           buffer, x and e */
+        if (in->bytes_since_gc >= in->gc_threshold && in->gc_paused == 0)
+            collect_garbage(in, x, e);
+        goto eval;
+    }
+    if (f != NULL && f->type == BUILT) {
+        builtin_fn fn = f->value.builtin.fn;
+        if (fn == memoized_builtin) {
+            Memo* m = f->value.builtin.info->value.memo;
+            data** argv = in->args + in->args_len - argc;
+            unsigned int hash = memo_hash(argv, argc);
+            MemoEntry* hit = memo_find(m, argv, argc, hash);
+            if (hit != NULL) {
+                in->args_len -= argc;
+                val = hit->value;
+                goto ret;
+            }
+            k = push_frame(in, K_MEMO, create_list(in, argv, argc, NULL), NULL);
+            if (k == NULL)
+                goto ret;
+            k->f = f;
+            k->count = (int) hash;
+            f = m->proc;
+            goto apply;
+        }
+        if ((fn == force_builtin || fn == stream_cdr_builtin) && check_arity(in, f, argc)) {
+            val = in->args[--in->args_len];
+            if (fn == stream_cdr_builtin) {
+                if (val == NULL || val->type != PAIR) {
+                    report_error(in, "stream-cdr: expected stream\n");
+                    val = NULL;
+                    goto ret;
+                }
+                val = cdr(val);
+            }
+            goto force;
+        }
+        /* builtins that call procedures run inside the machine */
+        if ((fn == apply_builtin || (fn == map_builtin && argc == 2) || fn == eval_builtin) &&
+            check_arity(in, f, argc)) {
+            data** argv = in->args + in->args_len - argc;
+            if (fn == eval_builtin) {
+                x = argv[0];
+                e = in->glob_env;
+                in->args_len -= argc;
+                goto eval;
+            }
+            f = argv[0];
+            data* list = argv[1];
+            in->args_len -= argc;
+            if (fn == map_builtin) {
+                k = push_frame(in, K_MAP, list, NULL);
+                if (k == NULL)
+                    goto ret;
+                k->f = f;
+                goto map_next;
+            }
+            argc = 0;
+            for (; list != NULL && list->type == PAIR; list = cdr(list), argc++)
+                push_arg(in, car(list));
+            goto apply;
+        }
+        val = call_builtin(in, f, argc);
+        goto ret;
+    }
+    in->args_len -= argc;
+    val = NULL;
+    if (f != NULL && f->type == SYMBOL && is_operator(f->value.symbol))
+        val = apply_operator(in, f->value.symbol, argc, in->args + in->args_len);
+    goto ret;
+
+operand:
+    /* the top frame is K_ARITH, K_COMPARE or K_LOGIC */
+    k = &in->frames[in->frames_len - 1];
+    while (k->exp != NULL && k->exp->type == PAIR) {
+        Number n;
+        int r = (k->kind == K_LOGIC) ? NOT_SIMPLE : eval_number(in, car(k->exp), k->env, &n);
+        k = &in->frames[in->frames_len - 1];    /* a lazy definition may have moved it */
+        if (r == NOT_SIMPLE) {
+            x = car(k->exp);
+            e = k->env;
+            goto eval;
+        }
+        if (r == 0) {
+            in->frames_len--;
+            val = NULL;
+            goto ret;
+        }
+        if (!fold_operand(in, k, &n, &val))
+            goto ret;
+    }
+    in->frames_len--;
+    if (k->kind == K_ARITH) {
+        char op = k->f->value.symbol[0];
+        val = arith_finish(in, op, &k->acc, k->count) ? box_number(in, &k->acc) : NULL;
+    } else if (k->kind == K_COMPARE) {
+        val = create_int(in, 1);
+        if (k->count < 2) {
+            report_error(in, "expected at least 2 arguments for relational operator\n");
+            val = NULL;
+        }
+    } else {
+        val = create_int(in, k->count);
+    }
+    goto ret;
+
+map_next:
+    k = &in->frames[in->frames_len - 1];
+    if (k->exp != NULL && k->exp->type == PAIR) {
+        push_arg(in, car(k->exp));
+        k->exp = cdr(k->exp);
+        f = k->f;
+        argc = 1;
+        goto apply;
+    }
+    val = list_from_args(in, k->base);
+    in->frames_len--;
+    goto ret;
+
+force:
+    /* val is the promise to force; other values force to themselves */
+    if (val == NULL || val->type != PROMISE || val->value.promise.done) {
+        if (val != NULL && val->type == PROMISE)
+            val = val->value.promise.result;
+        goto ret;
+    }
+    if (push_frame(in, K_FORCE, val, NULL) == NULL)
+        goto ret;
+    x = val->value.promise.exp;
+    e = val->value.promise.e;
+    goto eval;
+
+ret:
+    /* val is the value of the last form; hand it to the top frame */
+    if (in->error != NULL || in->frames_len == frames_base)
+        goto done;
+    k = &in->frames[in->frames_len - 1];
+    switch (k->kind) {
+        case K_IF:
+            in->frames_len--;
+            x = is_truthy(val) ? car(cdr(cdr(k->exp))) : car(cdr(cdr(cdr(k->exp))));
+            e = k->env;
+            goto eval;
+        case K_DEFINE:
+            in->frames_len--;
+            if (k->env == in->glob_env && is_operator(k->exp->value.symbol))
+                in->jit_enabled = 0;
+            define_variable(in, k->env, k->exp->value.symbol, val);
+            goto ret;
+        case K_HEAD:
+            in->frames_len--;
+            x = k->exp;
+            e = k->env;
+            f = val;
+            goto call;
+        case K_ARGS:
+            push_arg(in, val);
+            k->count++;
+            k->exp = cdr(k->exp);
+            goto argument;
+        case K_ARITH:
+        case K_COMPARE: {
+            Number n;
+            if (!to_number(val, &n)) {
+                report_error(in, "expected number\n");
+                in->frames_len--;
+                val = NULL;
+                goto ret;
+            }
+            if (!fold_operand(in, k, &n, &val))
+                goto ret;
+            goto operand;
+        }
+        case K_LOGIC:
+            k->exp = cdr(k->exp);
+            if (strcmp(k->f->value.symbol, "and") == 0)
+                k->count = k->count && is_truthy(val);
+            else
+                k->count = k->count || is_truthy(val);
+            goto operand;
+        case K_MAP:
+            push_arg(in, val);
+            goto map_next;
+        case K_STREAM:
+            in->frames_len--;
+            val = create_pair(in, val, create_promise(in, car(cdr(cdr(k->exp))), k->env, 0));
+            goto ret;
+        case K_FORCE: {
+            data* p = k->exp;
+            if (!settle_promise(p, val)) {
+                x = p->value.promise.exp;
+                e = p->value.promise.e;
+                goto eval;
+            }
+            in->frames_len--;
+            val = p->value.promise.result;
+            goto ret;
+        }
+        case K_MEMO:
+            in->frames_len--;
+            memo_store(in, k->f->value.builtin.info->value.memo, k->exp, (unsigned int) k->count, val);
+            goto ret;
+    }
+
+done:
+    in->eval_depth--;
+    if (in->error != NULL) {
+        in->frames_len = frames_base;
+        in->args_len = args_base;
+        return NULL;
+    }
+    return val;
+}
+
+void* eval(Interp* in, void* exp, Env* e) {
+    return run_machine(in, (data*) exp, e, NULL, 0);
+}
+
+/* Applies f to the top argc values of the argument buffer and pops them. */
+data* apply_procedure(Interp* in, data* f, int argc) {
+    if (f == NULL) {
+        in->args_len -= argc;
+        return NULL;
+    }
+    return run_machine(in, NULL, NULL, f, argc);
+}
+
+/* Optimizer. Runs once over every top-level form before it is evaluated:
+   folds operator and pure builtin calls whose arguments are constants,
+   drops the untaken branch of an if with a constant test, inlines
+   ((lambda (x ...) body) arg ...) and calls of small non-recursive global
+   procedures, and uses the values of globals defined as constants.
+
+   Whatever depends on a global binding (an inlined procedure, a constant
+   global) is wrapped in (#%guard ((name . value) ...) fast slow): eval
+   takes the optimized fast branch only while every name is still bound to
+   the same value, and the original code otherwise, so redefinitions keep
+   working. Operators and builtins are assumed not to be redefined. */
+#define INLINE_MAX_NODES 24
+#define INLINE_MAX_DEPTH 4
+
+typedef struct Scope {
+    data* names;            /* parameter list of an enclosing lambda */
+    struct Scope* parent;
+} Scope;
+
+typedef struct {
+    Interp* in;
+    data* deps;             /* guards needed by the value being folded */
+    int inline_depth;
+} Optimizer;
+
+data* optimize(Optimizer* o, data* exp, Scope* scope);
+
+int in_scope(Scope* scope, char* name) {
+    for (; scope != NULL; scope = scope->parent) {
+        data* p = scope->names;
+        for (; p != NULL && p->type == PAIR; p = cdr(p)) {
+            if (car(p) != NULL && car(p)->type == SYMBOL && strcmp(car(p)->value.symbol, name) == 0)
+                return 1;
+        }
+        if (p != NULL && p->type == SYMBOL && strcmp(p->value.symbol, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int head_is(data* exp, const char* name) {
+    return exp != NULL && exp->type == PAIR && car(exp) != NULL && car(exp)->type == SYMBOL &&
+           strcmp(car(exp)->value.symbol, name) == 0;
+}
+
+int is_literal(data* exp) {
+    return exp != NULL && (exp->type == INTEGER || exp->type == FLOAT ||
+                           exp->type == RATIONAL || exp->type == STRING);
+}
+
+/* Builds the expression that evaluates to value. */
+data* quote_value(Interp* in, data* value) {
+    if (is_literal(value))
+        return value;
+    return create_pair(in, create_symbol(in, "quote"), create_pair(in, value, NULL));
+}
+
+/* Value of a constant expression, or NULL. A global symbol bound to a
+   number or string counts as constant; it is recorded in o->deps. */
+int constant_value(Optimizer* o, data* exp, Scope* scope, data** value) {
+    if (is_literal(exp)) {
+        *value = exp;
+        return 1;
+    }
+    if (head_is(exp, "quote")) {
+        *value = car(cdr(exp));
+        return 1;
+    }
+    if (exp != NULL && exp->type == SYMBOL && !in_scope(scope, exp->value.symbol)) {
+        data* v = (data*) lookup(o->in->glob_env, exp->value.symbol);
+        if (is_literal(v)) {
+            o->deps = create_pair(o->in, create_pair(o->in, exp, v), o->deps);
+            *value = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Wraps the folded expression in a guard if it used constant globals. */
+data* guarded(Optimizer* o, data* deps, data* fast, data* slow) {
+    if (deps == NULL)
+        return fast;
+    Interp* in = o->in;
+    return create_pair(in, create_symbol(in, "#%guard"),
+                       create_pair(in, deps, create_pair(in, fast, create_pair(in, slow, NULL))));
+}
+
+int count_nodes(data* exp) {
+    if (exp == NULL || exp->type != PAIR)
+        return 1;
+    int n = 0;
+    for (; exp != NULL && exp->type == PAIR; exp = cdr(exp))
+        n += count_nodes(car(exp));
+    return n;
+}
+
+/* Does exp mention the symbol name anywhere outside quoted data? */
+int mentions(data* exp, char* name) {
+    if (exp == NULL)
+        return 0;
+    if (exp->type == SYMBOL)
+        return strcmp(exp->value.symbol, name) == 0;
+    if (exp->type != PAIR || head_is(exp, "quote"))
+        return 0;
+    for (; exp != NULL && exp->type == PAIR; exp = cdr(exp)) {
+        if (mentions(car(exp), name))
+            return 1;
+    }
+    return 0;
+}
+
+/* Checks that body can be inlined: no define or other special form that
+   binds names, and no inner lambda that rebinds a parameter or binds one
+   of the symbols passed as arguments (it would capture them). */
+int inlinable_body(data* body, data* params, data* args) {
+    if (body == NULL || body->type != PAIR || head_is(body, "quote"))
+        return 1;
+    if (head_is(body, "define") || (car(body) != NULL && car(body)->type == SYMBOL &&
+                                    is_special_form(car(body)->value.symbol) &&
+                                    !head_is(body, "if") && !head_is(body, "lambda") &&
+                                    !head_is(body, "#%guard")))
+        return 0;
+    if (head_is(body, "lambda")) {
+        Scope inner = { car(cdr(body)), NULL };
+        for (data* a = args; a != NULL && a->type == PAIR; a = cdr(a)) {
+            if (car(a) != NULL && car(a)->type == SYMBOL && in_scope(&inner, car(a)->value.symbol))
+                return 0;
+        }
+        for (data* p = params; p != NULL && p->type == PAIR; p = cdr(p)) {
+            if (in_scope(&inner, car(p)->value.symbol))
+                return 0;
+        }
+    }
+    for (; body != NULL && body->type == PAIR; body = cdr(body)) {
+        if (!inlinable_body(car(body), params, args))
+            return 0;
+    }
+    return 1;
+}
+
+/* Replaces the free occurrences of params in exp by the matching args. */
+data* substitute(Interp* in, data* exp, data* params, data* args) {
+    if (exp == NULL)
+        return NULL;
+    if (exp->type == SYMBOL) {
+        data* a = args;
+        for (data* p = params; p != NULL && p->type == PAIR; p = cdr(p), a = cdr(a)) {
+            if (strcmp(car(p)->value.symbol, exp->value.symbol) == 0)
+                return car(a);
+        }
+        return exp;
+    }
+    if (exp->type != PAIR || head_is(exp, "quote"))
+        return exp;
+    data* head = NULL;
+    data* tail = NULL;
+    for (; exp != NULL && exp->type == PAIR; exp = cdr(exp)) {
+        data* cell = create_pair(in, substitute(in, car(exp), params, args), NULL);
+        if (head == NULL)
+            head = cell;
+        else
+            tail->value.pairs.second = cell;
+        tail = cell;
+    }
+    if (tail != NULL)
+        tail->value.pairs.second = exp;
+    return head;
+}
+
+/* Arguments that can be substituted without changing how often or in
+   which order anything is evaluated. Operator names are left out: as
+   arguments they evaluate to plain symbols, not procedures. */
+int trivial_args(data* args) {
+    for (; args != NULL && args->type == PAIR; args = cdr(args)) {
+        data* a = car(args);
+        if (a != NULL && a->type == SYMBOL) {
+            if (is_operator(a->value.symbol) || is_special_form(a->value.symbol))
+                return 0;
+        } else if (!is_literal(a) && !head_is(a, "quote")) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int proper_params(data* params) {
+    for (; params != NULL && params->type == PAIR; params = cdr(params)) {
+        if (car(params) == NULL || car(params)->type != SYMBOL)
+            return 0;
+    }
+    return params == NULL;
+}
+
+/* Inlines (lambda params body) applied to args, or returns NULL. */
+data* inline_lambda(Optimizer* o, data* params, data* body, data* args, Scope* scope) {
+    if (o->inline_depth >= INLINE_MAX_DEPTH || !proper_params(params) ||
+        list_length(params) != list_length(args) || !trivial_args(args) ||
+        !inlinable_body(body, params, args))
+        return NULL;
+    o->inline_depth++;
+    data* result = optimize(o, substitute(o->in, body, params, args), scope);
+    o->inline_depth--;
+    return result;
+}
+
+/* Builtins without side effects that are safe to run at optimization time
+   on constant arguments of the right type. They return numbers or parts of
+   their arguments, never fresh cells such as cons would, since a folded
+   result is shared by every evaluation of the call. */
+int foldable_builtin(data* f, int argc, data** argv) {
+    builtin_fn fn = f->value.builtin.fn;
+    for (int i = 0; i < argc; i++) {
+        if (argv[i] == NULL)
+            return fn == null_builtin || fn == length_builtin;
+    }
+    if (fn == car_builtin || fn == cdr_builtin)
+        return argv[0]->type == PAIR;
+    if (fn == length_builtin || fn == null_builtin ||
+        fn == equal_builtin || fn == eq_builtin || fn == number_p_builtin)
+        return 1;
+    builtin_fn numeric[] = {
+        sqrt_builtin, exp_builtin, log_builtin, sin_builtin, cos_builtin, atan_builtin,
+        floor_builtin, ceiling_builtin, round_builtin, truncate_builtin, abs_builtin,
+        min_builtin, max_builtin, expt_builtin, exact_to_inexact_builtin,
+        exact_p_builtin, inexact_p_builtin
+    };
+    for (size_t k = 0; k < sizeof(numeric) / sizeof(numeric[0]); k++) {
+        if (fn == numeric[k]) {
+            Number n;
+            for (int i = 0; i < argc; i++) {
+                if (!to_number(argv[i], &n))
+                    return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Folds an operator or builtin call whose arguments are all constants.
+   args are already optimized. Returns NULL if it cannot be folded. */
+data* fold_call(Optimizer* o, data* head, data* args, Scope* scope) {
+    Interp* in = o->in;
+    char* name = head->value.symbol;
+    if (in_scope(scope, name))
+        return NULL;
+    data* global = (data*) lookup(in->glob_env, name);
+    int is_op = global == NULL && is_operator(name);
+    if (!is_op && (global == NULL || global->type != BUILT))
+        return NULL;
+
+    int argc = list_length(args);
+    data* saved_deps = o->deps;
+    o->deps = NULL;
+    int base = in->args_len;
+    for (data* it = args; it != NULL && it->type == PAIR; it = cdr(it)) {
+        data* v;
+        if (!constant_value(o, car(it), scope, &v)) {
+            in->args_len = base;
+            o->deps = saved_deps;
+            return NULL;
+        }
+        push_arg(in, v);
+    }
+
+    data* result = NULL;
+    int folded = 0;
+    if (is_op && (is_arithmetic(name) || is_comparison(name))) {
+        /* Evaluate on the quoted constants, unless that could fail. */
+        data* quoted = NULL;
+        Number n;
+        int numbers = argc > 0;
+        for (int i = argc - 1; i >= 0; i--) {
+            data* v = in->args[base + i];
+            if (!to_number(v, &n) || (name[0] == '/' && (i > 0 || argc == 1) &&
+                                      n.exact && n.num == 0))
+                numbers = 0;
+            quoted = create_pair(in, v, quoted);
+        }
+        if (numbers && (!is_comparison(name) || argc >= 2)) {
+            result = (data*) eval(in, create_pair(in, head, quoted), in->glob_env);
+            folded = result != NULL;
+        }
+        in->args_len = base;
+    } else if (!is_op && foldable_builtin(global, argc, in->args + base) &&
+               argc >= global->value.builtin.min_args &&
+               (global->value.builtin.max_args < 0 || argc <= global->value.builtin.max_args)) {
+        result = call_builtin(in, global, argc);
+        folded = 1;
+    } else {
+        in->args_len = base;
+    }
+
+    data* deps = o->deps;
+    o->deps = saved_deps;
+    if (!folded)
+        return NULL;
+    return guarded(o, deps, quote_value(in, result), create_pair(in, head, args));
+}
+
+data* optimize_list(Optimizer* o, data* list, Scope* scope) {
+    data* head = NULL;
+    data* tail = NULL;
+    for (; list != NULL && list->type == PAIR; list = cdr(list)) {
+        data* cell = create_pair(o->in, optimize(o, car(list), scope), NULL);
+        if (head == NULL)
+            head = cell;
+        else
+            tail->value.pairs.second = cell;
+        tail = cell;
+    }
+    if (tail != NULL)
+        tail->value.pairs.second = list;
+    return head;
+}
+
+data* optimize(Optimizer* o, data* exp, Scope* scope) {
+    Interp* in = o->in;
+    if (exp == NULL || exp->type != PAIR)
+        return exp;
+    data* head = car(exp);
+
+    if (head != NULL && head->type == SYMBOL && is_special_form(head->value.symbol)) {
+        char* name = head->value.symbol;
+        if (strcmp(name, "lambda") == 0 && list_length(exp) == 3) {
+            Scope inner = { car(cdr(exp)), scope };
+            data* body = optimize(o, car(cdr(cdr(exp))), &inner);
+            return create_pair(in, head, create_pair(in, car(cdr(exp)), create_pair(in, body, NULL)));
+        }
+        if (strcmp(name, "define") == 0 && list_length(exp) == 3) {
+            data* var = car(cdr(exp));
+            data* body = car(cdr(cdr(exp)));
+            if (var != NULL && var->type == PAIR) {
+                Scope inner = { cdr(var), scope };
+                if (scope != NULL)
+                    inner.names = var;   /* a local define also binds the name */
+                body = optimize(o, body, &inner);
+            } else {
+                body = optimize(o, body, scope);
+            }
+            return create_pair(in, head, create_pair(in, var, create_pair(in, body, NULL)));
+        }
+        if (strcmp(name, "if") == 0 && list_length(exp) == 4) {
+            data* test = optimize(o, car(cdr(exp)), scope);
+            data* saved_deps = o->deps;
+            o->deps = NULL;
+            data* v;
+            int constant = constant_value(o, test, scope, &v);
+            data* deps = o->deps;
+            o->deps = saved_deps;
+            data* then_ = optimize(o, car(cdr(cdr(exp))), scope);
+            data* else_ = optimize(o, car(cdr(cdr(cdr(exp)))), scope);
+            data* rebuilt = create_pair(in, head, create_pair(in, test,
+                                create_pair(in, then_, create_pair(in, else_, NULL))));
+            if (!constant)
+                return rebuilt;
+            return guarded(o, deps, is_truthy(v) ? then_ : else_, rebuilt);
+        }
+        if (strcmp(name, "#%guard") == 0 && list_length(exp) == 4) {
+            /* the slow branch is the original code and stays as it is */
+            data* fast = optimize(o, car(cdr(cdr(exp))), scope);
+            return guarded(o, car(cdr(exp)), fast, car(cdr(cdr(cdr(exp)))));
+        }
+        return exp;
+    }
+
+    data* args = optimize_list(o, cdr(exp), scope);
+
+    if (head_is(head, "lambda") && list_length(head) == 3) {
+        data* inlined = inline_lambda(o, car(cdr(head)), car(cdr(cdr(head))), args, scope);
+        if (inlined != NULL)
+            return inlined;
+    }
+    head = optimize(o, head, scope);
 
+    if (head != NULL && head->type == SYMBOL) {
+        data* folded = fold_call(o, head, args, scope);
+        if (folded != NULL)
+            return folded;
+        data* f = in_scope(scope, head->value.symbol) ? NULL
+                  : (data*) lookup(in->glob_env, head->value.symbol);
+        if (f != NULL && f->type == LAMBDA && f->value.lambda.e == in->glob_env &&
+            count_nodes(f->value.lambda.body) <= INLINE_MAX_NODES &&
+            !mentions(f->value.lambda.body, head->value.symbol)) {
+            /* The body's free names must not be captured at the call site. */
+            int captured = 0;
+            for (Scope* s = scope; s != NULL && !captured; s = s->parent) {
+                for (data* p = s->names; p != NULL && p->type == PAIR; p = cdr(p)) {
+                    if (car(p) != NULL && car(p)->type == SYMBOL &&
+                        !in_scope(&(Scope){ f->value.lambda.parameter, NULL }, car(p)->value.symbol) &&
+                        mentions(f->value.lambda.body, car(p)->value.symbol))
+                        captured = 1;
+                }
+            }
+            data* inlined = captured ? NULL
+                            : inline_lambda(o, f->value.lambda.parameter, f->value.lambda.body, args, scope);
+            if (inlined != NULL) {
+                data* dep = create_pair(in, create_pair(in, head, f), NULL);
+                return guarded(o, dep, inlined, create_pair(in, head, args));
+            }
+        }
+    }
+    return create_pair(in, head, args);
+}
+
+data* optimize_toplevel(Interp* in, data* exp) {
+    Optimizer o;
+    o.in = in;
+    o.deps = NULL;
+    o.inline_depth = 0;
+    in->gc_paused++;    /* the forms being built are only held in C locals */
+    data* result = optimize(&o, exp, NULL);
+    in->gc_paused--;
+    return result;
+}
 
-data* parse_func(TokenList* tokens, int* ind) {
+/* Parses one datum starting at *ind. The empty list is NULL as well, so a
+   failure is reported by clearing *ok. */
+data* parse_datum(Interp* in, TokenList* tokens, int* ind, int* ok) {
     if (*ind >= tokens->log_len) {
+        *ok = 0;
         return NULL;
     }
     char* tk = tokens->tokens[*ind];
     (*ind)++;
     if (strcmp(tk, "'") == 0) {
-        data* quoted_expr = parse_func(tokens, ind);
-        data* quote_sym = create_symbol("quote");
-        return create_pair(quote_sym, create_pair(quoted_expr, NULL));
+        data* quoted_expr = parse_datum(in, tokens, ind, ok);
+        if (!*ok)
+            return NULL;
+        data* quote_sym = create_symbol(in, "quote");
+        return create_pair(in, quote_sym, create_pair(in, quoted_expr, NULL));
     }
     if (strcmp(tk, "(") == 0) {
-        data* head = NULL;
-        data* tail = NULL;
+        /* the elements wait on the argument buffer, so the list's own
+           cells can be allocated in one run afterwards */
+        int base = in->args_len;
         while (*ind < tokens->log_len && strcmp(tokens->tokens[*ind], ")") != 0) {
-            data* elem = parse_func(tokens, ind);
-            if (elem == NULL)
+            data* elem = parse_datum(in, tokens, ind, ok);
+            if (!*ok) {
+                in->args_len = base;
                 return NULL;
-            if (head == NULL) {
-                head = create_pair(elem, NULL);
-                tail = head;
-            } else {
-                tail->value.pairs.second = create_pair(elem, NULL);
-                tail = tail->value.pairs.second;
             }
+            push_arg(in, elem);
         }
         if (*ind >= tokens->log_len) {
-            printf("Error: missing closing parenthesis\n");
+            in->args_len = base;
+            report_error(in, "Error: missing closing parenthesis\n");
+            *ok = 0;
             return NULL;
         }
         (*ind)++; 
-        return head;
+        return list_from_args(in, base);
     }
     if (strcmp(tk, ")") == 0) {
-        printf("Error: unexpected ')'\n");
+        report_error(in, "Error: unexpected ')'\n");
+        *ok = 0;
         return NULL;
     }
     
@@ -869,71 +4327,120 @@ data* parse_func(TokenList* tokens, int* ind) {
          char* inner = malloc(len - 1); 
          strncpy(inner, tk + 1, len - 2);
          inner[len - 2] = '\0';
-         data* d = create_string(inner);
+         data* d = create_string(in, inner);
          free(inner);
          return d;
     }
     char* end;
     long num = strtol(tk, &end, 10);
     if (*end == '\0') {
-         return create_int((int)num);
+         return create_int(in, (int)num);
     }
-    int is_float = 0;
-    for (char* p = tk; *p != '\0'; p++) {
-         if (*p == '.') {
-              is_float = 1;
-              break;
-         }
+    if (*end == '/' && end != tk && isdigit((unsigned char) end[-1]) && isdigit((unsigned char) end[1])) {
+         char* den_end;
+         long den = strtol(end + 1, &den_end, 10);
+         if (*den_end == '\0' && den != 0)
+              return create_rational(in, (int)num, (int)den);
     }
-    if (is_float) {
-         double d = atof(tk);
-         return create_float(d);
+    /* Anything else that starts like a number and is one as a whole
+       (3.14, .5, -2.5e3) is a float; inf and nan stay symbols. */
+    char* p = tk;
+    if (*p == '+' || *p == '-')
+         p++;
+    if (*p == '.')
+         p++;
+    if (isdigit((unsigned char) *p)) {
+         double d = strtod(tk, &end);
+         if (*end == '\0')
+              return create_float(in, d);
     }
-    return create_symbol(tk);
+    return create_symbol(in, tk);
+}
+
+/* Top-level forms, where NULL means there is nothing to evaluate. */
+data* parse_func(Interp* in, TokenList* tokens, int* ind) {
+    int ok = 1;
+    return parse_datum(in, tokens, ind, &ok);
 }
 
-data* parse(TokenList* tokens) {
+data* parse(Interp* in, TokenList* tokens) {
     int ind = 0;
-    return parse_func(tokens, &ind);
+    return parse_func(in, tokens, &ind);
 }
 
-void print_data(data* d) {
+void write_nested(FILE* out, data* d, int display, int depth) {
     if (!d) {
-        printf("NULL");
+        fprintf(out, "()");
+        return;
+    }
+    if (depth > MAX_NESTING) {
+        fprintf(out, "...");
         return;
     }
     switch(d->type) {
         case INTEGER:
-            printf("%d", d->value.integer);
+            fprintf(out, "%d", d->value.integer);
             break;
         case RATIONAL:
             if (d->value.rational.den == 1)
-                printf("%d", d->value.rational.num);
+                fprintf(out, "%d", d->value.rational.num);
             else
-                printf("%d/%d", d->value.rational.num, d->value.rational.den);
+                fprintf(out, "%d/%d", d->value.rational.num, d->value.rational.den);
             break;
-        case FLOAT:
-            printf("%g", d->value.floating);
+        case FLOAT: {
+            /* Always show a decimal point so inexact numbers are recognisable. */
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.15g", d->value.floating);
+            if (strpbrk(buf, ".eni") == NULL)
+                strcat(buf, ".0");
+            fputs(buf, out);
             break;
+        }
         case STRING:
-            printf("\"%s\"", d->value.string);
+            fprintf(out, display ? "%s" : "\"%s\"", d->value.string);
             break;
         case SYMBOL:
-            printf("%s", d->value.symbol);
+            fprintf(out, "%s", d->value.symbol);
             break;
         case LAMBDA:
-            printf("<lambda>");
+            fprintf(out, "<lambda>");
             break;
         case BUILT:
-            printf("<builtin>");
+            fprintf(out, "<builtin>");
+            break;
+        case HASHTABLE:
+            fprintf(out, "#<hash-table %d>", d->value.table->count);
+            break;
+        case PROMISE:
+            fprintf(out, "#<promise>");
+            break;
+        case PORT:
+            fprintf(out, d->value.port->input ? "#<input-port>" : "#<output-port>");
+            break;
+        case RECORD:
+            fprintf(out, "#<%s", car(d->value.record.type)->value.symbol);
+            for (int i = 0; i < d->value.record.count; i++) {
+                fprintf(out, " ");
+                write_nested(out, d->value.record.slots[i], display, depth + 1);
+            }
+            fprintf(out, ">");
+            break;
+        case MEMO:
+            fprintf(out, "#<memo-table %d>", d->value.memo->count);
+            break;
+        case BYTEVECTOR:
+            fprintf(out, "#u8(");
+            for (size_t i = 0; i < d->value.bytevector.length; i++)
+                fprintf(out, i > 0 ? " %d" : "%d", d->value.bytevector.bytes[i]);
+            fprintf(out, ")");
             break;
         case PAIR: {
-            printf("(");
+            fprintf(out, "(");
             data* iter = d;
             int first = 1;
             while (iter && iter->type == PAIR) {
-                if (!first) printf(" ");
-                print_data(car(iter));
+                if (!first) fprintf(out, " ");
+                write_nested(out, car(iter), display, depth + 1);
                 first = 0;
                 data* rest = cdr(iter);
                 if (!rest)
@@ -941,32 +4448,179 @@ void print_data(data* d) {
                 else if (rest->type == PAIR)
                     iter = rest;
                 else {
-                    printf(" . ");
-                    print_data(rest);
+                    fprintf(out, " . ");
+                    write_nested(out, rest, display, depth + 1);
                     iter = NULL;
                 }
             }
-            printf(")");
-            break;
+            fprintf(out, ")");
+            break;
+        }
+        default:
+            fprintf(out, "unknown");
+    }
+}
+
+/* Prints d to out. display leaves the quotes off strings. */
+void write_data(FILE* out, data* d, int display) {
+    write_nested(out, d, display, 0);
+}
+
+void print_data(data* d) {
+    write_data(stdout, d, 0);
+}
+
+
+void free_token_list(TokenList* t_list) {
+    if (t_list) {
+        for (int i = 0; i < t_list->log_len; i++) {
+            free(t_list->tokens[i]);
+        }
+        free(t_list->tokens);
+        free(t_list);
+    }
+}
+
+/* Garbage collection. Mark and sweep over the interpreter's object and
+   environment lists. It runs between top-level forms (maybe_collect) and at
+   the evaluator's safe point when a procedure is entered. The roots are the
+   global environment, the last result, the evaluator's frames and argument
+   buffer, and the expression and environment it is about to evaluate.
+   Native code that holds values across a call back into the evaluator must
+   keep them on the argument buffer; the optimizer pauses collection. */
+#define GC_MIN_THRESHOLD (4 * 1024 * 1024)
+
+/* Marking works from a stack of gray values and environments on the heap
+   rather than by recursion, so a long promise chain or a deeply nested
+   car does not use up the C stack. Values are marked when pushed. */
+void push_gray(Interp* in, data* d, Env* e) {
+    if (in->gray_len >= in->gray_cap) {
+        in->gray_cap = in->gray_cap ? in->gray_cap * 2 : 256;
+        in->gray = realloc(in->gray, in->gray_cap * sizeof(Gray));
+        if (in->gray == NULL) {
+            fprintf(stderr, "out of memory\n");
+            abort();
+        }
+    }
+    in->gray[in->gray_len].d = d;
+    in->gray[in->gray_len].e = e;
+    in->gray_len++;
+}
+
+void mark_data(Interp* in, data* d) {
+    if (d != NULL && !d->marked) {
+        d->marked = 1;
+        push_gray(in, d, NULL);
+    }
+}
+
+void mark_env(Interp* in, Env* e) {
+    if (e != NULL && !e->marked) {
+        e->marked = 1;
+        push_gray(in, NULL, e);
+    }
+}
+
+/* Marks everything reachable from the gray stack. */
+void drain_gray(Interp* in) {
+    while (in->gray_len > 0) {
+        Gray g = in->gray[--in->gray_len];
+        if (g.e != NULL) {
+            mark_env(in, g.e->parent);
+            for (Node* curr = g.e->begin; curr != NULL; curr = curr->next)
+                mark_data(in, curr->value);
+            continue;
+        }
+        data* d = g.d;
+        switch (d->type) {
+            case PAIR:
+                /* the car first, so walking a long list keeps the stack short */
+                mark_data(in, cdr(d));
+                mark_data(in, car(d));
+                break;
+            case LAMBDA:
+                mark_data(in, d->value.lambda.parameter);
+                mark_env(in, d->value.lambda.e);
+                mark_jit_code(in, d->value.lambda.jit);
+                mark_data(in, d->value.lambda.body);
+                break;
+            case PROMISE:
+                mark_data(in, d->value.promise.result);
+                mark_env(in, d->value.promise.e);
+                mark_data(in, d->value.promise.exp);
+                break;
+            case BUILT:
+                mark_data(in, d->value.builtin.info);
+                break;
+            case RECORD:
+                for (int i = 0; i < d->value.record.count; i++)
+                    mark_data(in, d->value.record.slots[i]);
+                mark_data(in, d->value.record.type);
+                break;
+            case MEMO: {
+                Memo* m = d->value.memo;
+                for (MemoEntry* e = m->newest; e != NULL; e = e->older) {
+                    mark_data(in, e->key);
+                    mark_data(in, e->value);
+                }
+                mark_data(in, m->proc);
+                break;
+            }
+            case HASHTABLE: {
+                HashTable* t = d->value.table;
+                for (int i = 0; i < t->capacity; i++) {
+                    if (t->entries[i].state == SLOT_FULL) {
+                        mark_data(in, t->entries[i].key);
+                        mark_data(in, t->entries[i].value);
+                    }
+                }
+                break;
+            }
+            default:
+                break;
         }
-        default:
-            printf("unknown");
     }
 }
 
-
-void free_token_list(TokenList* t_list) {
-    if (t_list) {
-        for (int i = 0; i < t_list->log_len; i++) {
-            free(t_list->tokens[i]);
-        }
-        free(t_list->tokens);
-        free(t_list);
+/* Frees what a value owns; its cell goes back to the slab. */
+void free_object(data* d) {
+    switch (d->type) {
+        case SYMBOL:
+            free(d->value.symbol);
+            break;
+        case STRING:
+            free(d->value.string);
+            break;
+        case HASHTABLE:
+            free(d->value.table->entries);
+            free(d->value.table);
+            break;
+        case LAMBDA:
+            free_jit_code(d->value.lambda.jit);
+            break;
+        case RECORD:
+            free(d->value.record.slots);
+            break;
+        case MEMO:
+            free_memo(d->value.memo);
+            break;
+        case BYTEVECTOR:
+            if (d->value.bytevector.mapped && d->value.bytevector.length > 0)
+                munmap(d->value.bytevector.bytes, d->value.bytevector.length);
+            else
+                free(d->value.bytevector.bytes);
+            break;
+        case PORT:
+            close_port(d->value.port);
+            free(d->value.port->buf);
+            free(d->value.port);
+            break;
+        default:
+            break;
     }
 }
 
 void free_environment(Env* env) {
-    if (env == NULL) return;
     Node* curr = env->begin;
     while (curr != NULL) {
         Node* next = curr->next;
@@ -974,33 +4628,109 @@ void free_environment(Env* env) {
         free(curr);       
         curr = next;
     }
-    free_environment(env->parent);
     free(env);  
 }
 
+void collect_garbage(Interp* in, data* exp, Env* env) {
+    mark_env(in, in->glob_env);
+    mark_data(in, in->last_result);
+    mark_data(in, in->autoloads);
+    for (int i = 0; i < in->modules_len; i++)
+        mark_env(in, in->modules[i].env);
+    mark_data(in, exp);
+    mark_env(in, env);
+    for (int i = 0; i < in->args_len; i++)
+        mark_data(in, in->args[i]);
+    for (int i = 0; i < in->frames_len; i++) {
+        mark_data(in, in->frames[i].exp);
+        mark_data(in, in->frames[i].f);
+        mark_env(in, in->frames[i].env);
+    }
+    drain_gray(in);
+
+    /* sweep the slabs, giving empty ones back and threading the free
+       cells of the others again */
+    in->free_cells = NULL;
+    Slab** slab_link = &in->slabs;
+    while (*slab_link != NULL) {
+        Slab* s = *slab_link;
+        int live = 0;
+        for (size_t i = 0; i < SLAB_CELLS; i++) {
+            if (!s->used[i])
+                continue;
+            data* d = &s->cells[i];
+            if (d->marked) {
+                d->marked = 0;
+                live = 1;
+            } else {
+                free_object(d);
+                s->used[i] = 0;
+                in->live_objects--;
+            }
+        }
+        if (live) {
+            in->free_cells = thread_free_cells(s, in->free_cells);
+            slab_link = &s->next;
+        } else {
+            *slab_link = s->next;
+            unmap_slab(s);
+        }
+    }
+    Env** env_link = &in->envs;
+    while (*env_link != NULL) {
+        Env* env = *env_link;
+        if (env->marked) {
+            env->marked = 0;
+            env_link = &env->gc_next;
+        } else {
+            *env_link = env->gc_next;
+            free_environment(env);
+        }
+    }
+
+    in->bytes_since_gc = 0;
+    in->gc_threshold = 2 * in->live_objects * sizeof(data);
+    if (in->gc_threshold < GC_MIN_THRESHOLD)
+        in->gc_threshold = GC_MIN_THRESHOLD;
+}
+
+/* Called by the top-level loops between forms. */
+void maybe_collect(Interp* in) {
+    if (in->bytes_since_gc >= in->gc_threshold)
+        collect_garbage(in, NULL, NULL);
+}
 
 
-data* load_builtin(data* args) {
-    data* fileNameNode = car(args);
-    data* evaluated = (data*) eval(fileNameNode, glob_env);
-    if (evaluated == NULL ||
-       (evaluated->type != SYMBOL && evaluated->type != STRING)) {
-        fprintf(stderr, "load: expected a file name as a symbol or string\n");
-        return NULL;
+/* Optimizes and evaluates one top-level form in the global environment. */
+data* eval_toplevel(Interp* in, data* ast) {
+    data* original = ast;
+    if (in->optimize) {
+        ast = optimize_toplevel(in, ast);
+        if (in->dump_optimized) {
+            printf("; ");
+            print_data(ast);
+            printf("\n");
+        }
     }
-    
-    char* fileText;
-    if (evaluated->type == STRING)
-        fileText = evaluated->value.string;
-    else
-        fileText = evaluated->value.symbol;
-    
-    char* filename = strdup(fileText);
-    
+    if (in->eval_depth == 0) {
+        in->fuel = in->fuel_limit > 0 ? in->fuel_limit : LONG_MAX;
+        in->alloc_stop = in->alloc_limit > 0 ? in->bytes_allocated + in->alloc_limit : SIZE_MAX;
+        if (in->reserve == NULL)
+            in->reserve = malloc(RESERVE_BYTES);
+    }
+    push_arg(in, original);     /* the caller looks at it afterwards */
+    push_arg(in, ast);
+    data* result = (data*) eval(in, ast, in->glob_env);
+    in->args_len -= 2;
+    return result;
+}
+
+/* Reads a whole file into a new string, or prints an error for who and
+   returns NULL. */
+char* read_file(const char* filename, const char* who) {
     FILE* f = fopen(filename, "r");
     if (!f) {
-        fprintf(stderr, "load: cannot open file %s\n", filename);
-        free(filename);
+        fprintf(stderr, "%s: cannot open file %s\n", who, filename);
         return NULL;
     }
     fseek(f, 0, SEEK_END);
@@ -1009,15 +4739,38 @@ data* load_builtin(data* args) {
     
     char* buffer = malloc(fileSize + 1);
     if (!buffer) {
-        fprintf(stderr, "load: memory allocation error\n");
+        fprintf(stderr, "%s: memory allocation error\n", who);
         fclose(f);
-        free(filename);
         return NULL;
     }
     size_t bytesRead = fread(buffer, 1, fileSize, f);
     buffer[bytesRead] = '\0';
     fclose(f);
-    free(filename);
+    return buffer;
+}
+
+/* Reads and evaluates a file in the global environment, printing
+   the result of every form that is not a define. */
+data* load_builtin(Interp* in, int argc, data** argv) {
+    data* evaluated = argv[0];
+    if (evaluated == NULL ||
+       (evaluated->type != SYMBOL && evaluated->type != STRING)) {
+        fprintf(stderr, "load: expected a file name as a symbol or string\n");
+        in->errors++;
+        return NULL;
+    }
+    
+    char* fileText;
+    if (evaluated->type == STRING)
+        fileText = evaluated->value.string;
+    else
+        fileText = evaluated->value.symbol;
+    
+    char* buffer = read_file(fileText, "load");
+    if (buffer == NULL) {
+        in->errors++;
+        return NULL;
+    }
     
     TokenList* t_list = create_list_of_tokens();
     tokenize_input(t_list, buffer);
@@ -1025,10 +4778,12 @@ data* load_builtin(data* args) {
     
     int pos = 0;
     while (pos < t_list->log_len) {
-        data* ast = parse_func(t_list, &pos);
+        data* ast = parse_func(in, t_list, &pos);
         if (ast == NULL)
             break;
-        data* res = (data*) eval(ast, glob_env);
+        data* res = eval_toplevel(in, ast);
+        if (in->error != NULL)
+            break;
         if (!(ast->type == PAIR &&
               car(ast)->type == SYMBOL &&
               strcmp(car(ast)->value.symbol, "define") == 0)) {
@@ -1037,34 +4792,848 @@ data* load_builtin(data* args) {
                 printf("\n");
             }
         }
-        free_data(ast);
     }
     
     free_token_list(t_list);
     
-    return create_symbol("#<unspecified>");
+    return create_symbol(in, "#<unspecified>");
+}
+
+/* Modules. (require "lib.scm") evaluates a file at most once per
+   interpreter. A file that declares (export name ...) is a module: its
+   forms run in an environment of their own below the global one and only
+   the exported names are bound globally, so its other definitions cannot
+   collide with anything else. Files without exports are evaluated in the
+   global environment, as by load.
+   (require "lib.scm" 'lazy) only indexes the file's top-level defines; each
+   one is evaluated the first time its name is looked up. The remaining
+   forms still run at require time. */
+/* Name bound by (define name ...) or (define (name ...) ...), or NULL. */
+data* defined_name(data* form) {
+    if (!head_is(form, "define"))
+        return NULL;
+    data* target = car(cdr(form));
+    if (target != NULL && target->type == PAIR)
+        target = car(target);
+    return target != NULL && target->type == SYMBOL ? target : NULL;
+}
+
+int is_exported(data* exports, char* name) {
+    for (data* it = exports; it != NULL && it->type == PAIR; it = cdr(it)) {
+        if (car(it) != NULL && car(it)->type == SYMBOL && strcmp(car(it)->value.symbol, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int env_reaches(Env* e, Env* target) {
+    for (; e != NULL; e = e->parent) {
+        if (e == target)
+            return 1;
+    }
+    return 0;
+}
+
+/* Evaluates the lazy definition of name that is visible from e, if there
+   is one, and returns its value; otherwise the global value of name. A
+   module's own definitions come before a global binding of the same name.
+   x and e are kept on a frame meanwhile so the collector sees them; the
+   form x is part of must be reachable too. Entries are lists
+   (form module exported). */
+data* autoload(Interp* in, data* x, Env* e, char* name) {
+    Node* global = lookup_node(in->glob_env, name);
+    data key;
+    key.type = SYMBOL;
+    key.value.symbol = name;
+    HashTable* t = in->autoloads->value.table;
+    int found;
+    data* prev = NULL;
+    for (data* it = hash_table_get(t, &key, &found); it != NULL; prev = it, it = cdr(it)) {
+        data* entry = car(it);
+        Env* home = in->modules[car(cdr(entry))->value.integer].env;
+        int exported = car(cdr(cdr(entry)))->value.integer;
+        int own = home != in->glob_env && env_reaches(e, home);
+        if (global != NULL ? !own : !exported && !env_reaches(e, home))
+            continue;
+        if (home != in->glob_env)
+            home->lazy--;
+        if (prev != NULL)
+            prev->value.pairs.second = cdr(it);
+        else if (cdr(it) != NULL)
+            hash_table_put(in, t, &key, cdr(it));
+        else
+            hash_table_remove(t, &key);
+
+        if (push_frame(in, K_HEAD, x, e) == NULL)
+            return NULL;
+        push_arg(in, entry);
+        if (home == in->glob_env)
+            eval_toplevel(in, car(entry));
+        else
+            eval(in, car(entry), home);
+        in->args_len--;
+        in->frames_len--;
+        Node* node = lookup_node(home, name);
+        data* value = node != NULL ? (data*) node->value : NULL;
+        if (exported && home != in->glob_env && in->error == NULL)
+            define_variable(in, in->glob_env, name, value);
+        return value;
+    }
+    return global != NULL ? (data*) global->value : NULL;
+}
+
+/* lookup for the evaluator: a name that is not bound yet may still have a
+   lazy definition waiting for it, and so may a global name that a module
+   with lazy definitions left shadows. */
+data* lookup_value(Interp* in, data* x, Env* e, char* name) {
+    int lazy = 0;
+    for (Env* cur = e; cur != NULL; cur = cur->parent) {
+        Node* node = lookup_node(cur, name);
+        if (node != NULL && (cur != in->glob_env || !lazy))
+            return (data*) node->value;
+        lazy |= cur->lazy;
+    }
+    if (in->autoloads == NULL || is_operator(name))
+        return NULL;
+    return autoload(in, x, e, name);
+}
+
+data* require_builtin(Interp* in, int argc, data** argv) {
+    data* file = argv[0];
+    if (file == NULL || file->type != STRING) {
+        report_error(in, "require: expected a file name string\n");
+        return NULL;
+    }
+    int lazy = argc == 2;
+    if (lazy && (argv[1] == NULL || argv[1]->type != SYMBOL || strcmp(argv[1]->value.symbol, "lazy") != 0)) {
+        report_error(in, "require: unknown option\n");
+        return NULL;
+    }
+    char* path = realpath(file->value.string, NULL);
+    if (path == NULL) {
+        report_error(in, "require: cannot open file %s\n", file->value.string);
+        return NULL;
+    }
+    for (int i = 0; i < in->modules_len; i++) {
+        if (strcmp(in->modules[i].path, path) == 0) {
+            free(path);
+            return create_symbol(in, "#<unspecified>");
+        }
+    }
+    char* buffer = read_file(path, "require");
+    if (buffer == NULL) {
+        in->errors++;
+        free(path);
+        return NULL;
+    }
+    TokenList* t_list = create_list_of_tokens();
+    tokenize_input(t_list, buffer);
+    free(buffer);
+
+    /* read the whole file first to learn its exports */
+    data* forms = NULL;
+    data* last = NULL;
+    data* exports = NULL;
+    int pos = 0;
+    while (pos < t_list->log_len) {
+        data* ast = parse_func(in, t_list, &pos);
+        if (ast == NULL)
+            break;
+        if (head_is(ast, "export")) {
+            for (data* it = cdr(ast); it != NULL && it->type == PAIR; it = cdr(it)) {
+                if (car(it) != NULL && car(it)->type == SYMBOL)
+                    exports = create_pair(in, car(it), exports);
+            }
+            continue;
+        }
+        data* cell = create_pair(in, ast, NULL);
+        if (last == NULL)
+            forms = cell;
+        else
+            last->value.pairs.second = cell;
+        last = cell;
+    }
+    free_token_list(t_list);
+
+    /* registered before evaluating, so requiring it again from inside is a no-op */
+    Env* env = exports != NULL ? create_environment(in, in->glob_env) : in->glob_env;
+    int index = in->modules_len++;
+    in->modules = realloc(in->modules, in->modules_len * sizeof(Module));
+    in->modules[index].path = path;
+    in->modules[index].env = env;
+
+    push_arg(in, forms);
+    push_arg(in, exports);
+    if (lazy) {
+        if (in->autoloads == NULL)
+            in->autoloads = create_hash_table_data(in, 1);
+        HashTable* t = in->autoloads->value.table;
+        for (data* it = forms; it != NULL; it = cdr(it)) {
+            data* name = defined_name(car(it));
+            if (name == NULL)
+                continue;
+            data* entry = create_pair(in, car(it),
+                          create_pair(in, create_int(in, index),
+                          create_pair(in, create_int(in, is_exported(exports, name->value.symbol)), NULL)));
+            int found;
+            if (hash_table_put(in, t, name, create_pair(in, entry, hash_table_get(t, name, &found))) &&
+                env != in->glob_env)
+                env->lazy++;
+        }
+    }
+    for (data* it = forms; it != NULL && in->error == NULL; it = cdr(it)) {
+        if (lazy && defined_name(car(it)) != NULL)
+            continue;
+        if (env == in->glob_env)
+            eval_toplevel(in, car(it));
+        else
+            eval(in, car(it), env);
+    }
+    if (!lazy && env != in->glob_env && in->error == NULL) {
+        for (data* it = exports; it != NULL && it->type == PAIR; it = cdr(it)) {
+            char* name = car(it)->value.symbol;
+            Node* node = lookup_node(env, name);
+            if (node == NULL)
+                report_error(in, "require: %s is not defined in %s\n", name, file->value.string);
+            else
+                define_variable(in, in->glob_env, name, node->value);
+        }
+    }
+    in->args_len -= 2;
+    return create_symbol(in, "#<unspecified>");
+}
+
+
+
+
+
+
+void register_builtin(Interp* in, const char* name, builtin_fn fn, int min_args, int max_args) {
+    add_elements_to_environment(in, in->glob_env, (char*) name, create_builtin(in, name, fn, min_args, max_args));
+}
+
+Interp* create_interpreter(void) {
+    Interp* in = malloc(sizeof(Interp));
+    in->slabs = NULL;
+    in->free_cells = NULL;
+    in->envs = NULL;
+    in->live_objects = 0;
+    in->bytes_since_gc = 0;
+    in->gc_threshold = GC_MIN_THRESHOLD;
+    in->last_result = NULL;
+    in->jit_enabled = 1;
+    in->jit_bail = 0;
+    in->jit_stack_limit = 0;
+    in->optimize = 1;
+    in->dump_optimized = 0;
+    in->glob_env = create_environment(in, NULL);
+    in->args_cap = 64;
+    in->args_len = 0;
+    in->args = malloc(in->args_cap * sizeof(data*));
+    in->frames_cap = 256;
+    in->frames_len = 0;
+    in->frames = malloc(in->frames_cap * sizeof(Frame));
+    in->stack_limit = DEFAULT_STACK_LIMIT;
+    in->eval_depth = 0;
+    in->fuel_limit = 0;
+    in->fuel = LONG_MAX;
+    in->alloc_limit = 0;
+    in->bytes_allocated = 0;
+    in->alloc_stop = SIZE_MAX;
+    in->reserve = malloc(RESERVE_BYTES);
+    in->modules = NULL;
+    in->modules_len = 0;
+    in->autoloads = NULL;
+    in->callee = NULL;
+    in->errors = 0;
+    in->gray = NULL;
+    in->gray_len = 0;
+    in->gray_cap = 0;
+    in->error = NULL;
+    in->gc_paused = 0;
+
+    register_builtin(in, "cons", cons_builtin, 2, 2);
+    register_builtin(in, "car", car_builtin, 1, 1);
+    register_builtin(in, "cdr", cdr_builtin, 1, 1);
+    register_builtin(in, "map", map_builtin, 2, -1);
+    register_builtin(in, "for-each", for_each_builtin, 2, -1);
+    register_builtin(in, "filter", filter_builtin, 2, 2);
+    register_builtin(in, "fold-left", fold_left_builtin, 3, -1);
+    register_builtin(in, "fold-right", fold_right_builtin, 3, -1);
+    register_builtin(in, "reduce", reduce_builtin, 3, 3);
+    register_builtin(in, "assoc", assoc_builtin, 2, 2);
+    register_builtin(in, "member", member_builtin, 2, 2);
+    register_builtin(in, "reverse", reverse_builtin, 1, 1);
+    register_builtin(in, "list-tail", list_tail_builtin, 2, 2);
+    register_builtin(in, "sort", sort_builtin, 2, 2);
+    register_builtin(in, "append", append_builtin, 2, 2);
+    register_builtin(in, "null?", null_builtin, 1, 1);
+    register_builtin(in, "length", length_builtin, 1, 1);
+    register_builtin(in, "apply", apply_builtin, 2, 2);
+    register_builtin(in, "eval", eval_builtin, 1, 1);
+    register_builtin(in, "load", load_builtin, 1, 1);
+    register_builtin(in, "require", require_builtin, 1, 2);
+    register_builtin(in, "equal?", equal_builtin, 2, 2);
+    register_builtin(in, "eq?", eq_builtin, 2, 2);
+    register_builtin(in, "number?", number_p_builtin, 1, 1);
+    register_builtin(in, "exact?", exact_p_builtin, 1, 1);
+    register_builtin(in, "inexact?", inexact_p_builtin, 1, 1);
+    register_builtin(in, "exact->inexact", exact_to_inexact_builtin, 1, 1);
+    register_builtin(in, "inexact->exact", inexact_to_exact_builtin, 1, 1);
+    register_builtin(in, "sqrt", sqrt_builtin, 1, 1);
+    register_builtin(in, "exp", exp_builtin, 1, 1);
+    register_builtin(in, "log", log_builtin, 1, 1);
+    register_builtin(in, "sin", sin_builtin, 1, 1);
+    register_builtin(in, "cos", cos_builtin, 1, 1);
+    register_builtin(in, "atan", atan_builtin, 1, 1);
+    register_builtin(in, "expt", expt_builtin, 2, 2);
+    register_builtin(in, "floor", floor_builtin, 1, 1);
+    register_builtin(in, "ceiling", ceiling_builtin, 1, 1);
+    register_builtin(in, "round", round_builtin, 1, 1);
+    register_builtin(in, "truncate", truncate_builtin, 1, 1);
+    register_builtin(in, "abs", abs_builtin, 1, 1);
+    register_builtin(in, "min", min_builtin, 1, -1);
+    register_builtin(in, "max", max_builtin, 1, -1);
+    register_builtin(in, "quotient", quotient_builtin, 2, 2);
+    register_builtin(in, "remainder", remainder_builtin, 2, 2);
+    register_builtin(in, "modulo", modulo_builtin, 2, 2);
+    register_builtin(in, "make-hash-table", make_hash_table_builtin, 0, 1);
+    register_builtin(in, "hash-table?", hash_table_p_builtin, 1, 1);
+    register_builtin(in, "hash-table-ref", hash_table_ref_builtin, 2, 3);
+    register_builtin(in, "hash-table-set!", hash_table_set_builtin, 3, 3);
+    register_builtin(in, "hash-table-delete!", hash_table_delete_builtin, 2, 2);
+    register_builtin(in, "hash-table-contains?", hash_table_contains_builtin, 2, 2);
+    register_builtin(in, "hash-table-count", hash_table_count_builtin, 1, 1);
+    register_builtin(in, "hash-table-keys", hash_table_keys_builtin, 1, 1);
+    register_builtin(in, "hash-table-values", hash_table_values_builtin, 1, 1);
+    register_builtin(in, "hash-table->alist", hash_table_alist_builtin, 1, 1);
+    register_builtin(in, "open-input-file", open_input_file_builtin, 1, 1);
+    register_builtin(in, "open-output-file", open_output_file_builtin, 1, 1);
+    register_builtin(in, "close-port", close_port_builtin, 1, 1);
+    register_builtin(in, "read", read_builtin, 1, 1);
+    register_builtin(in, "read-char", read_char_builtin, 1, 1);
+    register_builtin(in, "peek-char", peek_char_builtin, 1, 1);
+    register_builtin(in, "read-line", read_line_builtin, 1, 1);
+    register_builtin(in, "write", write_builtin, 1, 2);
+    register_builtin(in, "display", display_builtin, 1, 2);
+    register_builtin(in, "newline", newline_builtin, 0, 1);
+    register_builtin(in, "eof-object?", eof_object_p_builtin, 1, 1);
+    register_builtin(in, "make-bytevector", make_bytevector_builtin, 1, 2);
+    register_builtin(in, "bytevector", bytevector_builtin, 0, -1);
+    register_builtin(in, "bytevector?", bytevector_p_builtin, 1, 1);
+    register_builtin(in, "bytevector-length", bytevector_length_builtin, 1, 1);
+    register_builtin(in, "bytevector-u8-ref", bytevector_u8_ref_builtin, 2, 2);
+    register_builtin(in, "bytevector-u8-set!", bytevector_u8_set_builtin, 3, 3);
+    register_builtin(in, "bytevector-u16-native-ref", bytevector_u16_native_ref_builtin, 2, 2);
+    register_builtin(in, "bytevector-s32-native-ref", bytevector_s32_native_ref_builtin, 2, 2);
+    register_builtin(in, "bytevector-u32-native-ref", bytevector_u32_native_ref_builtin, 2, 2);
+    register_builtin(in, "bytevector-copy", bytevector_copy_builtin, 1, 3);
+    register_builtin(in, "bytevector-copy!", bytevector_copy_to_builtin, 3, 5);
+    register_builtin(in, "bytevector-index", bytevector_index_builtin, 2, 4);
+    register_builtin(in, "utf8->string", utf8_to_string_builtin, 1, 3);
+    register_builtin(in, "string->utf8", string_to_utf8_builtin, 1, 1);
+    register_builtin(in, "mmap-file", mmap_file_builtin, 1, 1);
+    register_builtin(in, "memoize", memoize_builtin, 1, 2);
+    register_builtin(in, "memoize-stats", memoize_stats_builtin, 1, 1);
+    register_builtin(in, "force", force_builtin, 1, 1);
+    register_builtin(in, "make-promise", make_promise_builtin, 1, 1);
+    register_builtin(in, "promise?", promise_p_builtin, 1, 1);
+    register_builtin(in, "stream-car", stream_car_builtin, 1, 1);
+    register_builtin(in, "stream-cdr", stream_cdr_builtin, 1, 1);
+    register_builtin(in, "stream-pair?", stream_pair_p_builtin, 1, 1);
+    register_builtin(in, "stream-null?", null_builtin, 1, 1);
+    eval_string(in, stream_prelude);
+    return in;
+}
+
+void set_jit_enabled(Interp* in, int enabled) {
+    in->jit_enabled = enabled;
+}
+
+void set_stack_limit(Interp* in, size_t bytes) {
+    in->stack_limit = bytes;
+}
+
+void set_eval_limits(Interp* in, long fuel, size_t bytes) {
+    in->fuel_limit = fuel;
+    in->alloc_limit = bytes;
+}
+
+const char* last_error(Interp* in) {
+    return in->error;
+}
+
+void set_optimizer(Interp* in, int enabled, int dump) {
+    in->optimize = enabled;
+    in->dump_optimized = dump;
+}
+
+void free_interpreter(Interp* in) {
+    if (in == NULL) return;
+    while (in->slabs != NULL) {
+        Slab* next = in->slabs->next;
+        for (size_t i = 0; i < SLAB_CELLS; i++) {
+            if (in->slabs->used[i])
+                free_object(&in->slabs->cells[i]);
+        }
+        unmap_slab(in->slabs);
+        in->slabs = next;
+    }
+    while (in->envs != NULL) {
+        Env* next = in->envs->gc_next;
+        free_environment(in->envs);
+        in->envs = next;
+    }
+    for (int i = 0; i < in->modules_len; i++)
+        free(in->modules[i].path);
+    free(in->modules);
+    free(in->reserve);
+    free(in->gray);
+    free(in->args);
+    free(in->frames);
+    free(in);
+}
+
+data* eval_string(Interp* in, const char* src) {
+    TokenList* t_list = create_list_of_tokens();
+    tokenize_input(t_list, src);
+
+    data* result = NULL;
+    int pos = 0;
+    in->error = NULL;
+    while (pos < t_list->log_len && in->error == NULL) {
+        data* ast = parse_func(in, t_list, &pos);
+        if (ast == NULL)
+            break;
+        result = eval_toplevel(in, ast);
+        in->last_result = result;
+        maybe_collect(in);
+    }
+
+    free_token_list(t_list);
+    return result;
+}
+
+
+#ifndef SCHEME_EMBED
+
+/* Server mode. The parent loads the --load files once, then forks workers
+   that inherit the warmed-up interpreter and take turns accepting
+   connections on a Unix socket. Each line a client sends is evaluated and
+   answered with a header line, "ok N" or "error N", followed by N bytes:
+   what the request printed and a line holding its result. Definitions made
+   by a request stay in the worker that ran it. The line ":stats" is
+   answered the same way with counters the workers keep in shared memory. */
+#define LATENCY_BUCKETS 128
+
+typedef struct ServerStats {
+    long requests;
+    long errors;
+    double started;
+    long latency[LATENCY_BUCKETS];   /* 4 buckets per power of two of ns */
+} ServerStats;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void stop_server(int sig) {
+    (void)sig;
+    server_stopping = 1;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int latency_bucket(unsigned long ns) {
+    if (ns < 4)
+        return (int)ns;
+    int b = 63 - __builtin_clzl(ns);
+    int idx = 4 * (b - 1) + (int)((ns >> (b - 2)) & 3);
+    return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+/* Upper end of a bucket, in microseconds. */
+static double bucket_limit(int idx) {
+    if (idx < 4)
+        return (idx + 1) / 1e3;
+    int b = idx / 4 + 1;
+    return (double)((unsigned long)(4 + idx % 4 + 1) << (b - 2)) / 1e3;
+}
+
+static double latency_percentile(const long* counts, long total, double p) {
+    long rank = (long)(total * p);
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (counts[i] > 0 && seen > rank)
+            return bucket_limit(i);
+    }
+    return 0;
+}
+
+static void print_stats(ServerStats* stats) {
+    long counts[LATENCY_BUCKETS];
+    long total = 0;
+    int last = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&stats->latency[i], __ATOMIC_RELAXED);
+        total += counts[i];
+        if (counts[i] > 0)
+            last = i;
+    }
+    double uptime = now_seconds() - stats->started;
+    printf("requests=%ld errors=%ld throughput=%.1f/s p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n",
+           __atomic_load_n(&stats->requests, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->errors, __ATOMIC_RELAXED),
+           uptime > 0 ? total / uptime : 0.0,
+           latency_percentile(counts, total, 0.50),
+           latency_percentile(counts, total, 0.90),
+           latency_percentile(counts, total, 0.99),
+           total ? bucket_limit(last) : 0.0);
 }
 
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
 
+/* Sends the bytes a request left in scratch, after a header line with the
+   request's status and their length, and empties scratch for the next one. */
+static int send_reply(int fd, int scratch, int failed) {
+    off_t len = lseek(scratch, 0, SEEK_CUR);
+    char buf[4096];
+    int n = snprintf(buf, sizeof(buf), "%s %ld\n", failed ? "error" : "ok", (long)len);
+    int ok = write_all(fd, buf, n);
+    lseek(scratch, 0, SEEK_SET);
+    while (ok && len > 0) {
+        ssize_t got = read(scratch, buf, len < (off_t)sizeof(buf) ? (size_t)len : sizeof(buf));
+        if (got <= 0)
+            break;
+        ok = write_all(fd, buf, got);
+        len -= got;
+    }
+    lseek(scratch, 0, SEEK_SET);
+    if (ftruncate(scratch, 0) < 0)
+        ok = 0;
+    return ok;
+}
 
+/* Answers requests on one connection until the client closes it. While a
+   request runs, stdout and stderr point at a scratch file, so everything it
+   prints, error messages included, goes into its reply. A request fails if
+   it reported an error or was aborted. */
+static void serve_connection(Interp* in, int fd, ServerStats* stats) {
+    FILE* requests = fdopen(fd, "r");
+    if (requests == NULL) {
+        close(fd);
+        return;
+    }
+    FILE* scratch = tmpfile();
+    if (scratch == NULL) {
+        fclose(requests);
+        return;
+    }
+    int console_out = dup(STDOUT_FILENO);
+    int console_err = dup(STDERR_FILENO);
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &linecap, requests)) > 0) {
+        if (line[n-1] == '\n')
+            line[--n] = '\0';
+        if (n == 0)
+            continue;
+        fflush(stdout);
+        fflush(stderr);
+        dup2(fileno(scratch), STDOUT_FILENO);
+        dup2(fileno(scratch), STDERR_FILENO);
+        int failed = 0;
+        if (strcmp(line, ":stats") == 0) {
+            print_stats(stats);
+        } else {
+            double start = now_seconds();
+            long errors = in->errors;
+            data* result = eval_string(in, line);
+            failed = in->errors != errors || in->error != NULL;
+            if (failed)
+                __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+            print_data(result);
+            printf("\n");
+            fflush(stdout);
+            unsigned long ns = (unsigned long)((now_seconds() - start) * 1e9);
+            __atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats->latency[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+        }
+        fflush(stdout);
+        fflush(stderr);
+        dup2(console_out, STDOUT_FILENO);
+        dup2(console_err, STDERR_FILENO);
+        if (!send_reply(fd, fileno(scratch), failed))
+            break;
+    }
+    close(console_out);
+    close(console_err);
+    free(line);
+    fclose(scratch);
+    fclose(requests);
+}
 
+static pid_t spawn_worker(Interp* in, int listener, ServerStats* stats) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            _exit(1);
+        }
+        serve_connection(in, fd, stats);
+    }
+}
 
-int main() {
-    Env* env = create_environment(NULL);
-    glob_env = env;
+/* Listens on path with a pool of workers, replacing any that die, until
+   SIGINT or SIGTERM. */
+static int serve(Interp* in, const char* path, int workers) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "serve: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 128) < 0) {
+        perror(path);
+        close(listener);
+        return 1;
+    }
+    
+    ServerStats* stats = mmap(NULL, sizeof(ServerStats), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        close(listener);
+        unlink(path);
+        return 1;
+    }
+    memset(stats, 0, sizeof(ServerStats));
+    stats->started = now_seconds();
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    maybe_collect(in);
+    pid_t* pids = calloc(workers, sizeof(pid_t));
+    for (int i = 0; i < workers; i++)
+        pids[i] = spawn_worker(in, listener, stats);
+    printf("Serving on %s with %d workers.\n", path, workers);
+    fflush(stdout);
+    
+    while (!server_stopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] == pid && !server_stopping) {
+                fprintf(stderr, "serve: worker %d exited, restarting\n", (int)pid);
+                pids[i] = spawn_worker(in, listener, stats);
+            }
+        }
+    }
     
-    add_elements_to_environment(env, "cons", create_builtin(cons_builtin));
-    add_elements_to_environment(env, "car", create_builtin(car_builtin));
-    add_elements_to_environment(env, "cdr", create_builtin(cdr_builtin));
-    add_elements_to_environment(env, "map", create_builtin(map_builtin));
-    add_elements_to_environment(env, "append", create_builtin(append_builtin));
-    add_elements_to_environment(env, "null?", create_builtin(null_builtin));
-    add_elements_to_environment(env, "length", create_builtin(length_builtin));
-    add_elements_to_environment(env, "apply", create_builtin(apply_builtin));
-    add_elements_to_environment(env, "eval", create_builtin(eval_builtin));
-    add_elements_to_environment(env, "load", create_builtin(load_builtin));
-    add_elements_to_environment(env, "equal?", create_builtin(equal_builtin));
+    for (int i = 0; i < workers; i++)
+        kill(pids[i], SIGTERM);
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+    free(pids);
+    close(listener);
+    unlink(path);
+    munmap(stats, sizeof(ServerStats));
+    return 0;
+}
+
+/* Soak mode (--soak N). Runs N rounds of a workload that defines and
+   redefines globals, makes closures, records, streams and memoized
+   procedures, and loads tests.scm every SOAK_LOAD_EVERY rounds when it is
+   there. Twenty times along the way it collects garbage and samples the
+   resident set size and the live value count. It fails if either has grown
+   past its limit since the first sample, which is taken once the workload
+   has warmed up. Build with -fsanitize=address to have use-after-free
+   reported as well. */
+#define SOAK_LOAD_EVERY 1000
+#define SOAK_SAMPLES 20
+
+static const char* soak_forms[] = {
+    "(define soak-counter 0)",
+    "(define (soak-adder n) (lambda (x) (+ x n)))",
+    "(define soak-add (soak-adder 3))",
+    "(define soak-counter (soak-add soak-counter))",
+    "(define (soak-build n) (if (= n 0) '() (cons n (soak-build (- n 1)))))",
+    "(length (map (lambda (x) (* x x)) (soak-build 200)))",
+    "(fold-left + 0 (filter (lambda (x) (= 0 (remainder x 3))) (soak-build 100)))",
+    "(define soak-table (make-hash-table))",
+    "(hash-table-set! soak-table (soak-build 3) \"three\")",
+    "(hash-table-ref soak-table '(3 2 1))",
+    "(define-record-type soak-point (make-soak-point x y) soak-point? (x soak-x) (y soak-y set-soak-y!))",
+    "(soak-x (make-soak-point soak-counter 2))",
+    "(define (soak-from n) (cons-stream n (soak-from (+ n 1))))",
+    "(stream-ref (stream-map (lambda (x) (* 2 x)) (soak-from 0)) 100)",
+    "(define-memoized (soak-fib n) (if (< n 2) n (+ (soak-fib (- n 1)) (soak-fib (- n 2)))))",
+    "(soak-fib 60)",
+    "(utf8->string (bytevector-copy (string->utf8 \"soak test\") 0 4))",
+    "(sort (soak-build 50) <)",
+};
+
+/* Resident set size in bytes, or 0 where /proc is not available. */
+static size_t resident_bytes(void) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    unsigned long size, resident;
+    int ok = f != NULL && fscanf(f, "%lu %lu", &size, &resident) == 2;
+    if (f != NULL)
+        fclose(f);
+    return ok ? resident * (size_t) sysconf(_SC_PAGESIZE) : 0;
+}
+
+static int soak(Interp* in, long rounds, size_t max_growth) {
+    FILE* tests = fopen("tests.scm", "r");
+    int load_tests = tests != NULL;
+    if (tests != NULL)
+        fclose(tests);
+    fprintf(stderr, "soak: %ld rounds of %d forms%s\n", rounds,
+            (int) (sizeof(soak_forms) / sizeof(soak_forms[0])),
+            load_tests ? ", loading tests.scm every 1000 rounds" : "");
+
+    /* the workload's output is thrown away */
+    fflush(stdout);
+    int console = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    long every = rounds / SOAK_SAMPLES > 0 ? rounds / SOAK_SAMPLES : 1;
+    size_t base_rss = 0;
+    long base_live = 0;
+    int failed = 0;
+    double start = now_seconds();
+    for (long round = 1; round <= rounds && !failed; round++) {
+        for (size_t i = 0; i < sizeof(soak_forms) / sizeof(soak_forms[0]); i++) {
+            eval_string(in, soak_forms[i]);
+            if (in->error != NULL) {
+                fprintf(stderr, "soak: round %ld: %s: %s\n", round, soak_forms[i], in->error);
+                failed = 1;
+            }
+        }
+        if (load_tests && round % SOAK_LOAD_EVERY == 1)
+            eval_string(in, "(load \"tests.scm\")");
+        if (round % every != 0)
+            continue;
+        fflush(stdout);
+        collect_garbage(in, NULL, NULL);
+        size_t rss = resident_bytes();
+        if (base_rss == 0 && base_live == 0) {
+            base_rss = rss;
+            base_live = in->live_objects;
+        }
+        fprintf(stderr, "soak: round %ld  %.1fs  rss %zu KB  live values %ld\n",
+                round, now_seconds() - start, rss / 1024, in->live_objects);
+        if (rss > base_rss + max_growth) {
+            fprintf(stderr, "soak: resident size grew by %zu KB\n", (rss - base_rss) / 1024);
+            failed = 1;
+        }
+        if (in->live_objects > 2 * base_live + 10000) {
+            fprintf(stderr, "soak: live values grew from %ld to %ld\n", base_live, in->live_objects);
+            failed = 1;
+        }
+    }
+
+    fflush(stdout);
+    dup2(console, STDOUT_FILENO);
+    close(console);
+    fprintf(stderr, "soak: %s\n", failed ? "FAILED" : "passed");
+    return failed;
+}
 
+int main(int argc, char** argv) {
+    Interp* in = create_interpreter();
+    const char* socket_path = NULL;
+    int workers = 4;
+    long soak_rounds = 0;
+    size_t soak_limit = 64 * 1024 * 1024;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-jit") == 0) {
+            set_jit_enabled(in, 0);
+        } else if (strcmp(argv[i], "--no-opt") == 0) {
+            set_optimizer(in, 0, 0);
+        } else if (strcmp(argv[i], "--dump-opt") == 0) {
+            set_optimizer(in, 1, 1);
+        } else if (strcmp(argv[i], "--stack-limit") == 0 && i + 1 < argc) {
+            set_stack_limit(in, strtoul(argv[++i], NULL, 10));
+        } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+            set_eval_limits(in, strtol(argv[++i], NULL, 10), in->alloc_limit);
+        } else if (strcmp(argv[i], "--max-alloc") == 0 && i + 1 < argc) {
+            set_eval_limits(in, in->fuel_limit, strtoul(argv[++i], NULL, 10));
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            data* file = create_string(in, argv[++i]);
+            if (load_builtin(in, 1, &file) == NULL)
+                return 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--soak") == 0 && i + 1 < argc && atol(argv[i+1]) > 0) {
+            soak_rounds = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--soak-limit") == 0 && i + 1 < argc) {
+            soak_limit = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [--no-jit] [--no-opt] [--dump-opt] [--stack-limit BYTES] "
+                            "[--fuel CALLS] [--max-alloc BYTES] [--load FILE]... [--serve SOCKET [--workers N]]\n"
+                            "       [--soak ROUNDS [--soak-limit BYTES]]\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    if (socket_path != NULL) {
+        int status = serve(in, socket_path, workers);
+        free_interpreter(in);
+        return status;
+    }
+    if (soak_rounds > 0) {
+        int status = soak(in, soak_rounds, soak_limit);
+        free_interpreter(in);
+        return status;
+    }
     
     printf("Scheme Interpreter. '(exit)' to quit.\n");
     
@@ -1083,12 +5652,14 @@ int main() {
         
         TokenList* t_list = create_list_of_tokens();
         tokenize_input(t_list, line);
-        data* ast = parse(t_list);
+        data* ast = parse(in, t_list);
         if (ast == NULL) {
             printf("Parse error.\n");
+            free_token_list(t_list);
             continue;
         }
-    data* result = (data*) eval(ast, env);
+    in->error = NULL;
+    data* result = eval_toplevel(in, ast);
 if (ast->type == PAIR && car(ast)->type == SYMBOL &&
     strcmp(car(ast)->value.symbol, "define") == 0) {
 } else if (result != NULL &&
@@ -1097,15 +5668,13 @@ if (ast->type == PAIR && car(ast)->type == SYMBOL &&
     print_data(result);
     printf("\n");
 }
-free_data(ast);
+maybe_collect(in);
 
         free_token_list(t_list);
     }
     
     free(line);
-    free_environment(env);
+    free_interpreter(in);
     return 0;
 }
-
-
-
+#endif
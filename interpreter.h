@@ -0,0 +1,152 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+/* Embedding interface. Every interpreter keeps its whole state in its own
+   Interp object, so independent interpreters can run on different threads
+   as long as a single Interp is only used by one thread at a time.
+   Build interpreter.c with -DSCHEME_EMBED to leave out the REPL main(). */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The environment struct. Keeping the name and value of function or variable.
+   This is linked lists*/
+typedef struct Node{
+    char* name;
+    void* value;
+    struct Node* next;
+} Node;
+
+typedef struct Env {
+    Node* begin;
+    struct Env* parent;
+    int lazy;       /* lazy definitions of a module still waiting */
+    int marked;
+    struct Env* gc_next;
+} Env;
+
+typedef struct Interp Interp;
+typedef struct HashTable HashTable;
+typedef struct JitCode JitCode;
+typedef struct Port Port;
+typedef struct Memo Memo;
+
+typedef enum { SYMBOL, INTEGER, FLOAT, RATIONAL, STRING, LAMBDA, PAIR, OPERATOR, BUILT, HASHTABLE, PROMISE, PORT, RECORD, BYTEVECTOR, MEMO} types;
+
+typedef struct data {
+    types type;
+    unsigned char marked;
+    union {
+        int integer;
+        struct {
+            int num;
+            int den;
+        } rational;
+        double floating;
+        char* symbol;
+        char* string;
+        struct {
+           /* void (*body)(int);
+            char* parameter;*/
+            struct data* parameter;
+            struct data* body;
+            Env* e;
+            JitCode* jit;
+        } lambda;
+        struct {
+            void* first;
+            void* second;
+        } pairs;
+        struct {
+            struct data* (*fn)(Interp* in, int argc, struct data** argv);
+            const char* name;
+            int min_args;
+            int max_args;
+            struct data* info;      /* extra data some builtins keep */
+        } builtin;
+        HashTable* table;
+        struct {
+            struct data* exp;       /* NULL once forced */
+            Env* e;
+            struct data* result;
+            int done;
+            int lazy;               /* made by delay-force */
+        } promise;
+        Port* port;
+        struct {
+            struct data* type;      /* descriptor, (name field ...) */
+            struct data** slots;
+            int count;
+        } record;
+        struct {
+            unsigned char* bytes;
+            size_t length;
+            int mapped;             /* read-only view of an mmap'd file */
+        } bytevector;
+        Memo* memo;
+    } value;
+} data;
+
+/* Native functions receive their evaluated arguments as an array. The
+   count has already been checked against the arity given at registration.
+   argv points into the evaluator's argument buffer and is only valid until
+   the function calls back into the evaluator. The collector may run during
+   such a call; the arguments themselves are kept alive, other values the
+   function has made so far are not. */
+typedef data* (*builtin_fn)(Interp* in, int argc, data** argv);
+
+/* Creates an interpreter with its own global environment and builtins. */
+Interp* create_interpreter(void);
+
+/* Frees the interpreter and every value it allocated. */
+void free_interpreter(Interp* in);
+
+/* Evaluates every form in src and returns the last result. Values belong
+   to the interpreter's garbage collector; the result stays valid until the
+   next call to eval_string. */
+data* eval_string(Interp* in, const char* src);
+
+/* Message of the error that aborted the last eval_string, such as running
+   out of stack, or NULL. Ordinary errors are printed and evaluate to NULL. */
+const char* last_error(Interp* in);
+
+/* Bytes the evaluator's control stack may grow to before deep recursion is
+   stopped with a "stack limit exceeded" error. The default is 64 MB. */
+void set_stack_limit(Interp* in, size_t bytes);
+
+/* Limits every top-level form to fuel procedure calls and bytes of newly
+   allocated values; a form that goes over stops with "fuel exhausted" or
+   "allocation limit exceeded". 0 means no limit, which is the default. */
+void set_eval_limits(Interp* in, long fuel, size_t bytes);
+
+/* Turns compilation of hot procedures to machine code on or off. */
+void set_jit_enabled(Interp* in, int enabled);
+
+/* Turns the optimizer pass on or off; with dump set, every optimized
+   top-level form is printed before it is evaluated. */
+void set_optimizer(Interp* in, int enabled, int dump);
+
+/* Binds name to a native function in the global environment. max_args of -1
+   accepts any number of arguments from min_args up. name must outlive in. */
+void register_builtin(Interp* in, const char* name, builtin_fn fn, int min_args, int max_args);
+
+/* Values are allocated in, and owned by, an interpreter. create_rational
+   returns NULL and sets last_error() when den is 0. */
+data* create_int(Interp* in, int val);
+data* create_float(Interp* in, double val);
+data* create_rational(Interp* in, int num, int den);
+data* create_string(Interp* in, const char* s);
+data* create_symbol(Interp* in, const char* val);
+data* create_pair(Interp* in, data* first, data* second);
+data* car(data* exp);
+data* cdr(data* exp);
+void print_data(data* d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
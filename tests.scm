@@ -69,10 +69,138 @@
 
 ;;;;;;;TEST17
 
-(if (equal? 1 (length? '(7))) "TEST17: LENGTH - SUCCESS" "TEST17: LENGTH - FAIL")
+(if (equal? 1 (length '(7))) "TEST17: LENGTH - SUCCESS" "TEST17: LENGTH - FAIL")
 
 ;;;;;;;TEST18
 
 (define (fact n)  (if (= n 0) 1 (* n (fact (- n 1)))))
 
 (if (equal? 120 (fact 5)) "TEST19: RECURSION - SUCCESS" "TEST19: RECURSION - FAIL")
+
+;;;;;;;TEST20
+
+(define table (make-hash-table))
+(hash-table-set! table '(1 2) "pair")
+(hash-table-set! table 2 "two")
+(if (equal? "two" (hash-table-ref table 2.0)) "TEST20: HASH_TABLE - SUCCESS" "TEST20: HASH_TABLE - FAIL")
+
+;;;;;;;TEST21
+
+(if (equal? 2.5 (+ 1 (* 3 0.5))) "TEST21: INEXACT - SUCCESS" "TEST21: INEXACT - FAIL")
+
+;;;;;;;TEST22
+
+(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(if (equal? 6765 (fib 20)) "TEST22: COMPILED_RECURSION - SUCCESS" "TEST22: COMPILED_RECURSION - FAIL")
+
+;;;;;;;TEST23
+
+(define (square x) (* x x))
+(define (area r) (* 3 (square r)))
+(define first-area (area 3))
+(define (square x) (+ x x))
+(if (equal? '(27 18) (cons first-area (cons (area 3) '()))) "TEST23: INLINE_REDEFINE - SUCCESS" "TEST23: INLINE_REDEFINE - FAIL")
+
+;;;;;;;TEST24
+
+(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))
+(if (equal? 100000 (length (build 100000))) "TEST24: DEEP_RECURSION - SUCCESS" "TEST24: DEEP_RECURSION - FAIL")
+
+;;;;;;;TEST25
+
+(define (integers-from n) (cons-stream n (integers-from (+ n 1))))
+(define evens (stream-filter (lambda (x) (= 0 (remainder x 2))) (integers-from 1)))
+(if (equal? '(4 16 36) (stream->list (stream-take 3 (stream-map (lambda (x) (* x x)) evens)))) "TEST25: STREAMS - SUCCESS" "TEST25: STREAMS - FAIL")
+
+;;;;;;;TEST26
+
+(define pairs '((2 b) (1 a) (2 c) (1 d)))
+(if (equal? '((1 a) (1 d) (2 b) (2 c)) (sort pairs (lambda (x y) (< (car x) (car y))))) "TEST26: STABLE_SORT - SUCCESS" "TEST26: STABLE_SORT - FAIL")
+
+;;;;;;;TEST27
+
+(if (equal? 32 (fold-left + 0 (map * '(1 2 3) '(4 5 6)))) "TEST27: FOLD_MAP - SUCCESS" "TEST27: FOLD_MAP - FAIL")
+
+;;;;;;;TEST28
+
+(define out (open-output-file "/tmp/scheme-test-port.txt"))
+(write '(1 "two" (three 4.5)) out)
+(close-port out)
+(define in-port (open-input-file "/tmp/scheme-test-port.txt"))
+(define datum (read in-port))
+(if (equal? (cons datum (cons (eof-object? (read in-port)) '())) '((1 "two" (three 4.5)) 1)) "TEST28: PORTS - SUCCESS" "TEST28: PORTS - FAIL")
+
+;;;;;;;TEST29
+
+(define module-port (open-output-file "/tmp/scheme-test-module.scm"))
+(write '(export scale) module-port)
+(write '(define factor 3) module-port)
+(write '(define (scale x) (* factor x)) module-port)
+(close-port module-port)
+(define factor 100)
+(require "/tmp/scheme-test-module.scm" 'lazy)
+(require "/tmp/scheme-test-module.scm")
+(define big-port (open-output-file "/tmp/scheme-test-big.scm"))
+(write '(export big-a big-b) big-port)
+(write '(define (count-up n acc) (if (= n 0) acc (count-up (- n 1) (cons n acc)))) big-port)
+(write '(define (len l n) (if (null? l) n (len (cdr l) (+ n 1)))) big-port)
+(write '(define big-a (* 2 (len (count-up 100000 '()) 0))) big-port)
+(write '(define big-b (* 2 (len (count-up 100000 '()) 0))) big-port)
+(close-port big-port)
+(require "/tmp/scheme-test-big.scm" 'lazy)
+(define big-sum (+ big-a big-b))
+(if (equal? (cons (scale 2) (cons factor (cons big-sum '()))) '(6 100 400000)) "TEST29: MODULES - SUCCESS" "TEST29: MODULES - FAIL")
+
+;;;;;;;TEST30
+
+(define-record-type point (make-point x y) point? (x point-x set-point-x!) (y point-y))
+(define pt (make-point 1 2))
+(set-point-x! pt 5)
+(if (equal? (cons (point-x pt) (cons (point-y pt) (cons (point? pt) (cons (point? 5) (cons (equal? pt (make-point 5 2)) '()))))) '(5 2 1 0 1)) "TEST30: RECORDS - SUCCESS" "TEST30: RECORDS - FAIL")
+
+;;;;;;;TEST31
+
+(define bytes (make-bytevector 6 0))
+(bytevector-copy! bytes 2 (bytevector 1 2 3 4) 1 3)
+(define mapped (mmap-file "/tmp/scheme-test-port.txt"))
+(if (equal? (cons bytes (cons (bytevector-u8-ref mapped 0) (cons (bytevector-index mapped 34) '()))) (cons (bytevector 0 0 2 3 0 0) '(40 3))) "TEST31: BYTEVECTORS - SUCCESS" "TEST31: BYTEVECTORS - FAIL")
+
+;;;;;;;TEST32
+
+(define-memoized (memo-fib n) (if (< n 2) n (+ (memo-fib (- n 1)) (memo-fib (- n 2)))))
+(define memo-square (memoize (lambda (x) (* x x)) 2))
+(memo-square 3)
+(memo-square 3)
+(if (equal? (cons (memo-fib 40) (cons (memoize-stats memo-square) '())) '(102334155 (1 1 1 2))) "TEST32: MEMOIZE - SUCCESS" "TEST32: MEMOIZE - FAIL")
+
+;;;;;;;TEST33
+
+(if (equal? (cons (expt 2 -1) (cons (expt 2/3 -3) (cons (expt 1 2000000000) (cons (expt 3 5) '())))) '(1/2 27/8 1 243)) "TEST33: EXACT_EXPT - SUCCESS" "TEST33: EXACT_EXPT - FAIL")
+
+;;;;;;;TEST34
+
+(define (fresh-pair) (cons 1 2))
+(if (equal? 0 (eq? (fresh-pair) (fresh-pair))) "TEST34: FRESH_CONS - SUCCESS" "TEST34: FRESH_CONS - FAIL")
+
+;;;;;;;TEST35
+
+(if (equal? 1 (equal? (build 500000) (build 500000))) "TEST35: LONG_EQUAL - SUCCESS" "TEST35: LONG_EQUAL - FAIL")
+
+;;;;;;;TEST36
+
+(define out (open-output-file "/tmp/scheme-test-empty.txt"))
+(write '(1 () 2 (() ())) out)
+(close-port out)
+(define in-port (open-input-file "/tmp/scheme-test-empty.txt"))
+(if (equal? (read in-port) '(1 () 2 (() ()))) "TEST36: READ_EMPTY_LISTS - SUCCESS" "TEST36: READ_EMPTY_LISTS - FAIL")
+
+;;;;;;;TEST37
+
+(define (nest n) (if (= n 0) '() (cons (nest (- n 1)) '())))
+(define nested (nest 300000))
+(if (equal? 1 (equal? nested (nest 300000))) "TEST37: NESTED_CARS - SUCCESS" "TEST37: NESTED_CARS - FAIL")
+
+;;;;;;;TEST38
+
+(define naturals (integers-from 0))
+(if (equal? 300000 (stream-ref naturals 300000)) "TEST38: RETAINED_STREAM - SUCCESS" "TEST38: RETAINED_STREAM - FAIL")